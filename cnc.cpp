@@ -11,6 +11,7 @@
 #include <vector>
 #include <utility>
 #include <algorithm>
+#include <deque>
 
 #include <unistd.h>
 
@@ -30,6 +31,8 @@ void cnc_machine::rebind(std::iostream& s)
     
 void cnc_machine::reset()
 {
+    // Soft reset drops G92 offsets; the first status report afterwards
+    // carries the offsets anew
     wco_ = {};
 
     s_->clear();
@@ -70,6 +73,7 @@ cnc_machine::status_t& cnc_machine::status()
 
     point wpos;
     point mpos;
+    vector wco;
     for (const std::string& field: split<std::string>(status, "|")) {
         if (field.substr(0, 4) == "Idle") {
             ret.idle = true;
@@ -80,7 +84,7 @@ cnc_machine::status_t& cnc_machine::status()
         } else if (field.substr(0, 5) == "MPos:") {
             mpos = point(field.substr(5));
         } else if (field.substr(0, 4) == "WCO:") {
-            wco_ = vector(field.substr(4));
+            wco = vector(field.substr(4));
         } else if (field.substr(0, 3) == "FS:") {
             auto fs = split<double>(field.substr(3), ",");
             ret.spindle_on = (fs.size() >= 2 && fs[1] >= 1);
@@ -90,14 +94,6 @@ cnc_machine::status_t& cnc_machine::status()
         }
     }
     
-    if (wpos.defined()) {
-        ret.position = wpos;
-    } else if (mpos.defined()) {
-        ret.position = mpos - wco();
-    } else {
-        throw grbl_error::protocol_violation();
-    }
-
     status.clear();
     while (status.empty()) {
         auto st = talk("$G");
@@ -123,6 +119,36 @@ cnc_machine::status_t& cnc_machine::status()
             continue;
         }
     }
+    
+    if (wco.defined())
+        wco_[ret.wcs] = wco;
+    
+    if (wpos.defined()) {
+        ret.position = wpos;
+    } else if (mpos.defined()) {
+        // Grbl reports WCO at least every 30 status reports. Failing that,
+        // the offsets are read with $#, which has to wait for the machine
+        // to stop (or alarm); wait() itself would need status() here
+        static const size_t MAX_WCO_POLLS = 30;
+        bool idle = ret.idle || ret.alarm;
+        for (size_t i = 0; !wco_[ret.wcs].defined() && (i < MAX_WCO_POLLS || !idle); ++i) {
+            if (i >= MAX_WCO_POLLS)
+                usleep(50000);
+            for (const std::string& st: talk("?")) {
+                if (st.empty() || st[0] != '<')
+                    continue;
+                idle = starts_with(st, "<Idle") || starts_with(st, "<Alarm");
+                for (const std::string& field: split<std::string>(st, "|"))
+                    if (field.substr(0, 4) == "WCO:")
+                        wco_[ret.wcs] = vector(field.substr(4));
+            }
+        }
+        if (!wco_[ret.wcs].defined())
+            read_offsets(true);
+        ret.position = mpos - wco_[ret.wcs];
+    } else {
+        throw grbl_error::protocol_violation();
+    }
 
     status_ = ret;
     return *status_;
@@ -141,28 +167,61 @@ void cnc_machine::wait()
     settings::g_params.dump_wire = dump;
 }
 
-std::string cnc_machine::read_hash(const std::string& name, size_t index)
+vector cnc_machine::wco()
 {
-    wait();
-    for (const std::string& line: talk("$#")) {
-        auto fields = split<std::string>(line, ":");
-        if (fields.size() > index && fields[0] == name)
-            return fields[index];
+    static const size_t WCO_POLLS = 3;
+    int wcs = status().wcs;
+    
+    // Grbl sends WCO in the first status report after it changes
+    for (size_t i = 0; !wco_[wcs].defined() && i != WCO_POLLS; ++i) {
+        status_.reset();
+        wcs = status().wcs;
     }
-    throw grbl_error::protocol_violation();
+    if (!wco_[wcs].defined())
+        read_offsets();
+    return wco_[wcs];
 }
 
-vector cnc_machine::wco()
+void cnc_machine::read_offsets(bool idle /* = false */)
 {
-    if (!wco_.defined())
-        wco_ = vector(read_hash("[G54", 1));
-    return wco_;
+    if (!idle)
+        wait();
+    std::map<std::string, vector> offsets;
+    for (const std::string& line: talk("$#")) {
+        auto fields = split<std::string>(line, ":");
+        if (fields.size() >= 2 && !fields[0].empty() && fields[0][0] == '[') {
+            if (fields[0] == "[TLO")
+                offsets[fields[0]] = vector::axis::z(lexical_cast<double>(fields[1]));
+            else if (fields[1].find(',') != std::string::npos)
+                offsets[fields[0]] = vector(fields[1]);
+        }
+    }
+    
+    // WCO reported in status is the sum of all the offsets in effect
+    vector g92 = offsets.count("[G92") ? offsets["[G92"] : vector::zero();
+    vector tlo = offsets.count("[TLO") ? offsets["[TLO"] : vector::zero();
+    for (int i = 0; i != 6; ++i) {
+        auto o = offsets.find("[G" + std::to_string(54 + i));
+        if (o == offsets.end())
+            throw grbl_error::protocol_violation();
+        wco_[i] = o->second + g92 + tlo;
+    }
 }
 
 void cnc_machine::redefine_position(point newpos)
 {
+    vector wco = wco_[wcs()];
+    point pos = position();
     talk("G10 P0 L20 " + newpos.grbl());
-    wco_ = vector();
+    
+    // Work position becomes `newpos` along the axes given
+    double* axes[] = { &wco.x, &wco.y, &wco.z };
+    const double* old_pos[] = { &pos.x, &pos.y, &pos.z };
+    const double* new_pos[] = { &newpos.x, &newpos.y, &newpos.z };
+    for (size_t i = 0; i != 3; ++i)
+        if (!std::isnan(*new_pos[i]))
+            *axes[i] += *old_pos[i] - *new_pos[i];
+    wco_[wcs()] = wco;
     status().position = newpos;
 }
 
@@ -203,17 +262,104 @@ void cnc_machine::feed_z(double z)
     status().position.z = z;
 }
 
-double cnc_machine::probe()
+cnc_machine::probe_result cnc_machine::probe(double approach_z /* = NAN */, double expected_z /* = NAN */)
 {
+    static const double TOUCH_FEED = 15;
+    const auto& params = settings::g_params;
     double prev_feed_rate = feed_rate();
-    talk("G38.2 F15 Z" + lexical_cast<std::string>(-max_travel().z - wco().z + 1));
-    wait();
-    double ret = (point(read_hash("[PRB", 1)) - wco()).z;
+    std::string limit = " Z" + lexical_cast<std::string>(-max_travel().z - wco().z + 1);
+    
+    probe_result ret = { NAN, NAN };
+    if (!std::isnan(approach_z)) {
+        if (approach_z < position().z)
+            move_z(approach_z, move_mode::unsafe);
+    } else if (params.probe_seek_feed > 0) {
+        std::string feed = " F" + lexical_cast<std::string>(params.probe_seek_feed);
+        if (std::isnan(expected_z)) {
+            ret.seek_z = (probe_contact(talk("G38.2" + feed + limit)) - wco()).z;
+        } else if (expected_z + params.probe_backoff < position().z) {
+            // Missing the surface above the expected height is fine: the touch goes on from there
+            point contact = probe_contact(talk("G38.3" + feed + " Z" + lexical_cast<std::string>(expected_z + params.probe_backoff)), true);
+            if (contact.defined())
+                ret.seek_z = (contact - wco()).z;
+        }
+        status_.reset();
+        if (!std::isnan(ret.seek_z))
+            move_z(ret.seek_z + params.probe_backoff, move_mode::unsafe);
+    }
+    
+    ret.z = (probe_contact(talk("G38.2 F" + lexical_cast<std::string>(TOUCH_FEED) + limit)) - wco()).z;
     set_feed_rate(prev_feed_rate);
     status_.reset();
     return ret;
 }
 
+std::vector<cnc_machine::probe_result> cnc_machine::probe_all(const std::vector<point>& pts, double travel_z)
+{
+    static const double TOUCH_FEED = 15;
+    const auto& params = settings::g_params;
+    double prev_feed_rate = feed_rate();
+    vector offset = wco();
+    std::string limit = " Z" + lexical_cast<std::string>(-max_travel().z - offset.z + 1);
+    std::string touch = "G38.2 F" + lexical_cast<std::string>(TOUCH_FEED) + limit;
+    bool seek = params.probe_seek_feed > 0;
+
+    std::vector<std::string> cmds;
+    for (const point& pt: pts) {
+        cmds.push_back("G0 Z" + lexical_cast<std::string>(travel_z));
+        cmds.push_back("G0 X" + lexical_cast<std::string>(pt.x) + " Y" + lexical_cast<std::string>(pt.y));
+        if (seek) {
+            cmds.push_back("G38.2 F" + lexical_cast<std::string>(params.probe_seek_feed) + limit);
+            cmds.push_back("G91 G0 Z" + lexical_cast<std::string>(params.probe_backoff));
+            cmds.push_back("G90");
+        }
+        cmds.push_back(touch);
+    }
+    cmds.push_back("G0 Z" + lexical_cast<std::string>(travel_z));
+
+    std::vector<std::string> resp;
+    try {
+        resp = stream(cmds);
+    } catch (const std::exception&) {
+        // A soft reset clears the feed rate along with the rest of the modal state
+        if (!status().alarm)
+            set_feed_rate(prev_feed_rate);
+        throw;
+    }
+
+    std::vector<double> contacts;
+    for (const std::string& line: resp)
+        if (starts_with(line, "[PRB:"))
+            contacts.push_back((probe_contact({ line }) - offset).z);
+    size_t per_point = seek ? 2 : 1;
+    if (contacts.size() != pts.size() * per_point)
+        throw grbl_error::protocol_violation();
+
+    std::vector<probe_result> ret;
+    for (size_t i = 0; i != pts.size(); ++i)
+        ret.push_back({ contacts[i * per_point + per_point - 1], seek ? contacts[i * per_point] : NAN });
+    set_feed_rate(prev_feed_rate);
+    return ret;
+}
+
+// Grbl reports each probe cycle with [PRB:x,y,z:success] in machine coordinates.
+// A cycle allowed to miss (G38.3) gives an undefined point when it did.
+point cnc_machine::probe_contact(const std::vector<std::string>& resp, bool may_miss /* = false */)
+{
+    for (const std::string& line: resp) {
+        auto fields = split<std::string>(line, ":");
+        if (fields.size() >= 3 && fields[0] == "[PRB") {
+            status_.reset();
+            if (!fields[2].empty() && fields[2][0] == '1')
+                return point(fields[1]);
+            if (may_miss)
+                return point();
+            throw grbl_error::protocol_violation();
+        }
+    }
+    throw grbl_error::protocol_violation();
+}
+
 class cnc_machine::tmpwcs {
 public:
     tmpwcs(cnc_machine& cnc, int wcs):
@@ -265,8 +411,7 @@ void cnc_machine::select_wcs(int wcs)
     if (wcs < 0 || wcs > 5)
         throw std::runtime_error("WCS must be in range 0..5");
     talk("G" + std::to_string(54 + wcs));
-    
-    wco_ = vector();
+    status().wcs = wcs;
 }
 
 void cnc_machine::set_spindle_speed(double speed)
@@ -301,16 +446,28 @@ void cnc_machine::send_gcmd(const gcmd& cmd)
 {
     talk(lexical_cast<std::string>(cmd));
     status_.reset();
+    if (cmd.equals('G', 10) || cmd.equals('G', 92))
+        wco_ = {};
 }
 
 std::vector<std::string> cnc_machine::talk(const std::string& cmd)
+{
+    send(cmd);
+    std::vector<std::string> resp;
+    while (!receive(resp)) {}
+    return resp;
+}
+
+void cnc_machine::send(const std::string& cmd)
 {
     if (settings::g_params.dump_wire)
         std::cerr << "\r\033[33m... send: " << cmd << "\033[0m" << std::endl;
 
     *s_ << cmd << std::endl;
+}
 
-    std::vector<std::string> resp;
+bool cnc_machine::receive(std::vector<std::string>& resp)
+{
     std::string line;
     while (std::getline(*s_, line)) {
         if (interactive::interrupted())
@@ -323,7 +480,7 @@ std::vector<std::string> cnc_machine::talk(const std::string& cmd)
             std::cerr << "\r\033[32m... recv: '" << line << "'\033[0m" << std::endl;
 
         if (line == "ok") {
-            return resp;
+            return true;
         } else if (starts_with(line, "error:")) {
             throw grbl_error(lexical_cast<int>(line.substr(6)));
         } else if (starts_with(line, "ALARM:")) {
@@ -333,14 +490,17 @@ std::vector<std::string> cnc_machine::talk(const std::string& cmd)
             std::cerr << line.substr(5, line.size() - 6) << std::endl;
         } else if (line.size() >= 2 && line[0] == '<' && line[line.size() - 1] == '>') {
             resp.push_back(line.substr(0, line.size() - 1));
+            return false;
         } else if (line.size() >= 2 && line[0] == '[' && line[line.size() - 1] == ']') {
             resp.push_back(line.substr(0, line.size() - 1));
+            return false;
         } else if (starts_with(line, "Grbl ")) {
             // CNC was reset by front-panel killswitch.
             reset(); // Clear what we may have sent afterwards
             throw grbl_reset();
         } else if (starts_with(line, "$") && line.find('=') != std::string::npos) {
             resp.push_back(line);
+            return false;
         } else {
             continue;
         }
@@ -352,6 +512,42 @@ std::vector<std::string> cnc_machine::talk(const std::string& cmd)
     throw grbl_error::protocol_violation();
 }
 
+std::vector<std::string> cnc_machine::stream(const std::vector<std::string>& cmds)
+{
+    // Size of Grbl's serial receive buffer; as long as the lines not yet
+    // acknowledged fit in there, the next one can be sent right away
+    static const size_t RX_BUFFER_SIZE = 128;
+
+    std::vector<std::string> resp;
+    std::deque<size_t> pending;
+    size_t buffered = 0;
+    try {
+        for (auto i = cmds.begin(); i != cmds.end() || !pending.empty();) {
+            if (i != cmds.end() && buffered + i->size() + 1 <= RX_BUFFER_SIZE) {
+                send(*i);
+                pending.push_back(i->size() + 1);
+                buffered += pending.back();
+                ++i;
+            } else if (receive(resp)) {
+                if (pending.empty())
+                    throw grbl_error::protocol_violation();
+                buffered -= pending.front();
+                pending.pop_front();
+            }
+        }
+    } catch (const grbl_reset&) {
+        throw;
+    } catch (...) {
+        // Lines still queued would go on moving the machine after we gave up
+        // on them; a soft reset stops it and drops them
+        if (!pending.empty())
+            reset();
+        throw;
+    }
+    status_.reset();
+    return resp;
+}
+
 double cnc_machine::setting(int index)
 {
     if (settings_.empty()) {
@@ -4,6 +4,7 @@
 #include "utility.h"
 #include <iosfwd>
 #include <map>
+#include <array>
 #include <vector>
 #include <string>
 #include <optional>
@@ -45,7 +46,21 @@ public:
     void move(point p, move_mode m = move_mode::safe);
     void move_xy(point p, move_mode m = move_mode::safe);
     void move_z(double z, move_mode m = move_mode::safe);
-    double probe();
+    // Contact heights of a probe: `z` from the slow precision touch,
+    // `seek_z` from the fast seek before it (NaN when there was none)
+    struct probe_result {
+        double z;
+        double seek_z;
+    };
+    // Probes the surface below. With `approach_z` given, rapids down to it
+    // and touches slowly from there instead of seeking the surface first.
+    // Otherwise, with `expected_z` known, the fast seek stops short of it
+    // rather than going all the way down.
+    probe_result probe(double approach_z = NAN, double expected_z = NAN);
+    // Probes at each of `pts` in turn, retracting to `travel_z` in between.
+    // The whole sequence is streamed at once, and contact heights are taken
+    // from the reports Grbl sends after each probe cycle.
+    std::vector<probe_result> probe_all(const std::vector<point>& pts, double travel_z);
     
     bool touches_ground() { return status().touches_ground; }
     
@@ -67,18 +82,32 @@ public:
     vector max_travel() { return vector_setting(130); }
     vector homing_direction() { return mask_setting(23); }
     double homing_pulloff() { return setting(27); }
+    vector max_rate() { return vector_setting(110); }
+    vector acceleration() { return vector_setting(120); }
+    double junction_deviation() { return setting(11); }
     
 private /*methods*/:
     status_t& status();
+    // Offset of the current work coordinate system, as reported in status
     vector wco();
+    // Reads offsets of all work coordinate systems with $#, which Grbl
+    // refuses while moving; waits for it to stop unless known to be idle
+    void read_offsets(bool idle = false);
     int wcs() { return status().wcs; }
     void select_wcs(int wcs);
     
     class tmpwcs;
     friend class tmpwcs;
     
-    std::string read_hash(const std::string& name, size_t index);
+    point probe_contact(const std::vector<std::string>& resp, bool may_miss = false);
     std::vector<std::string> talk(const std::string& cmd);
+    void send(const std::string& cmd);
+    // Reads a line, adding reports to `resp`; true on "ok"
+    bool receive(std::vector<std::string>& resp);
+    // Sends `cmds` without waiting for each to be acknowledged, as long as
+    // Grbl's receive buffer has room; returns all reports received meanwhile.
+    // Should a line fail, a soft reset drops the ones queued behind it.
+    std::vector<std::string> stream(const std::vector<std::string>& cmds);
     
     double setting(int index);
     vector vector_setting(int index);
@@ -87,7 +116,7 @@ private /*methods*/:
 private /*fields*/:
     std::iostream* s_;
     std::optional<status_t> status_;
-    vector wco_;
+    std::array<vector, 6> wco_;  // per work coordinate system; undefined until known
     std::map<int, double> settings_;
 };
 
@@ -1,6 +1,13 @@
 #include "gcode.h"
 #include "geom.h"
 #include "keyboard.h"
+#include "route.h"
+#include "planner.h"
+#include <numeric>
+#include <array>
+#include <unordered_set>
+#include <set>
+#include <algorithm>
 
 
 gcmd gcmd::parse(const ::point& last_point, const std::string& str)
@@ -83,6 +90,21 @@ void gcmd::set_point(const ::point& pt)
     pt_ = pt;
 }
 
+double gcmd::feed_rate(double prev) const
+{
+    if (letter() == 'F')
+        return lexical_cast<double>(str_arg());
+    auto i = tail_.find('F');
+    return (i != tail_.end()) ? i->second : prev;
+}
+
+void gcmd::set_delta(const ::vector& v)
+{
+    if (delta_.any_defined() != v.any_defined())
+        throw std::logic_error("trying to (un)define a delta");
+    delta_ = v;
+}
+
 std::ostream& operator << (std::ostream& s, const gcmd& c)
 {
     s << c.cmd_;
@@ -170,6 +192,753 @@ void gcode::break_long_legs()
     cmds_ = std::move(newcmds);
 }
 
+namespace {
+
+static const double EPSILON = 1e-6;
+
+bool is_motion(const gcmd& c)
+{
+    return c.letter() == 'G' && c.arg() >= 0 && c.arg() <= 3 && c.point().defined();
+}
+
+// Commands which may appear inside a chain without ending it
+bool is_chain_cmd(const gcmd& c)
+{
+    if (c.letter() == 'F')
+        return true;
+    else if (c.letter() != 'G')
+        return false;
+    else if (c.arg() >= 0 && c.arg() <= 3)
+        return c.point().defined() || !c.point().any_defined();
+    else
+        return c.arg() == 4;
+}
+
+bool same_xy(const point& a, const point& b) { return (b - a).project_xy().length() < EPSILON; }
+
+bool same_feed(double a, double b) { return (std::isnan(a) && std::isnan(b)) || fabs(a - b) < EPSILON; }
+
+double distance_xy(const point& p, const point& a, const point& b)
+{
+    vector ab = (b - a).project_xy();
+    double len2 = ab * ab;
+    double t = (len2 < EPSILON*EPSILON) ? 0 : std::min(1.0, std::max(0.0, ((p - a).project_xy() * ab) / len2));
+    return (p - (a + ab * t)).project_xy().length();
+}
+
+typedef std::pair<point, point> segment;
+
+// Part of the move from `a` to `b` staying within `r` of segment `s`, as
+// fractions [first, second] of the move; empty if first > second. Points
+// within `r` of a segment make up a convex capsule, so this is one interval.
+std::pair<double, double> covered_part(const point& a, const point& b, const segment& s, double r)
+{
+    vector d = (b - a).project_xy();
+    double lo = INFINITY, hi = -INFINITY;
+    auto extend = [&](double t0, double t1) {
+        if (t0 <= t1) {
+            lo = std::min(lo, t0);
+            hi = std::max(hi, t1);
+        }
+    };
+    
+    // Discs around the ends of the segment
+    for (const point& c: { s.first, s.second }) {
+        vector f = (a - c).project_xy();
+        double qa = d * d, qb = 2 * (f * d), qc = f * f - r * r;
+        double disc = qb * qb - 4 * qa * qc;
+        if (disc >= 0)
+            extend((-qb - sqrt(disc)) / (2 * qa), (-qb + sqrt(disc)) / (2 * qa));
+    }
+    
+    // The band along it, bounded by its sides and by the lines across its ends
+    vector u = (s.second - s.first).project_xy();
+    double len = u.length();
+    if (len > EPSILON) {
+        u = u / len;
+        vector n(-u.y, u.x, 0);
+        vector f = (a - s.first).project_xy();
+        double t0 = -INFINITY, t1 = INFINITY;
+        auto clip = [&](double p0, double dp, double min, double max) {
+            if (fabs(dp) < EPSILON * EPSILON) {
+                if (p0 < min || p0 > max)
+                    t0 = INFINITY;
+                return;
+            }
+            double ta = (min - p0) / dp, tb = (max - p0) / dp;
+            t0 = std::max(t0, std::min(ta, tb));
+            t1 = std::min(t1, std::max(ta, tb));
+        };
+        clip(f * u, d * u, 0, len);
+        clip(f * n, d * n, -r, r);
+        extend(t0, t1);
+    }
+    return { std::max(lo, 0.0), std::min(hi, 1.0) };
+}
+
+// Whether the tool going from `a` to `b` stays on the centerlines of `cuts`
+bool retraces(const point& a, const point& b, const std::vector<segment>& cuts)
+{
+    static const double TOLERANCE = 0.01 /*mm*/;
+    
+    if (same_xy(a, b)) {
+        return std::any_of(cuts.begin(), cuts.end(),
+            [&a](const segment& s) { return distance_xy(a, s.first, s.second) <= TOLERANCE; });
+    }
+    
+    std::vector<std::pair<double, double>> parts;
+    for (const segment& s: cuts) {
+        auto part = covered_part(a, b, s, TOLERANCE);
+        if (part.first <= part.second)
+            parts.push_back(part);
+    }
+    std::sort(parts.begin(), parts.end());
+    
+    double reached = 0;
+    for (const auto& part: parts) {
+        if (part.first > reached + EPSILON)
+            return false;
+        reached = std::max(reached, part.second);
+    }
+    return reached >= 1 - EPSILON;
+}
+
+// Cut segments are matched by their endpoints snapped to a fine grid
+typedef std::array<long long, 5> segment_key;
+
+struct segment_hash {
+    size_t operator()(const segment_key& k) const
+    {
+        size_t h = 0;
+        for (long long v: k)
+            h = h * 1000003 ^ std::hash<long long>()(v);
+        return h;
+    }
+};
+
+segment_key make_key(const point& a, const point& b)
+{
+    static const double GRID = 1e-3 /*mm*/;
+    auto snap = [](double v) { return (long long) llround(v / GRID); };
+    
+    std::pair<long long, long long> p(snap(a.x), snap(a.y)), q(snap(b.x), snap(b.y));
+    if (q < p)
+        std::swap(p, q);
+    return {{ p.first, p.second, q.first, q.second, snap(a.z) }};
+}
+
+bool is_cut(const point& a, const point& b)
+{
+    return a.z <= 0 && fabs(a.z - b.z) < EPSILON && !same_xy(a, b);
+}
+
+bool is_modal_only(const gcmd& c) { return c.letter() == 'F' || c.letter() == 'S'; }
+
+bool is_line(const gcmd& c) { return is_motion(c) && c.arg() <= 1; }
+
+// Center of the circle through three points in XY; undefined if they are collinear
+point circumcenter(const point& a, const point& b, const point& c)
+{
+    double bx = b.x - a.x, by = b.y - a.y, cx = c.x - a.x, cy = c.y - a.y;
+    double d = 2 * (bx*cy - by*cx);
+    if (fabs(d) < EPSILON)
+        return point();
+    double b2 = bx*bx + by*by, c2 = cx*cx + cy*cy;
+    return { a.x + (cy*b2 - by*c2) / d, a.y + (bx*c2 - cx*b2) / d, a.z };
+}
+
+// Whether polyline pts[0..last] lies within `tolerance` of an arc,
+// which is then returned through `center` and `ccw`.
+bool fit_arc(const std::vector<point>& pts, size_t last, double tolerance, point& center, bool& ccw)
+{
+    static const double MAX_RADIUS = 100 /*mm*/;
+    static const double MAX_SWEEP = 2*M_PI - 0.1;
+    
+    center = circumcenter(pts[0], pts[last / 2], pts[last]);
+    if (!center.defined())
+        return false;
+    double r = (pts[0] - center).project_xy().length();
+    if (r > MAX_RADIUS)
+        return false;
+    
+    auto off = [&center, r, tolerance](const point& p) {
+        return fabs((p - center).project_xy().length() - r) > tolerance;
+    };
+    
+    double sweep = 0;
+    for (size_t i = 0; i != last; ++i) {
+        vector u = (pts[i] - center).project_xy(), v = (pts[i+1] - center).project_xy();
+        double cross = u.x*v.y - u.y*v.x;
+        if (i == 0)
+            ccw = (cross > 0);
+        if (fabs(cross) < EPSILON || (cross > 0) != ccw)
+            return false;
+        if (off(pts[i+1]) || off(pts[i] + (pts[i+1] - pts[i]) / 2))
+            return false;
+        sweep += fabs(u.angle_to(v));
+    }
+    return sweep < MAX_SWEEP;
+}
+
+// Sweep of an arc from `start` to `end` around `center`, positive counterclockwise
+double arc_sweep(const point& start, const point& end, const point& center, bool ccw)
+{
+    double a = (start - center).project_xy().angle_to((end - center).project_xy());
+    if (ccw && a <= EPSILON)
+        a += 2*M_PI;
+    else if (!ccw && a >= -EPSILON)
+        a -= 2*M_PI;
+    return a;
+}
+
+} // namespace
+
+std::vector<gcode::chain> gcode::chains() const
+{
+    std::vector<chain> ret;
+    size_t section = 0;
+    point pos;
+    double feed = NAN;
+    bool in_chain = false;
+    
+    auto close = [&](size_t end) {
+        if (!in_chain)
+            return;
+        ret.back().end = end;
+        ret.back().exit = pos;
+        ret.back().feed_out = feed;
+        in_chain = false;
+    };
+    
+    for (size_t i = 0; i != cmds_.size(); ++i) {
+        const gcmd& c = cmds_[i];
+        if (!is_chain_cmd(c)) {
+            close(i);
+            ++section;
+        } else if (
+            c.equals('G', 0) && c.point().defined() && c.point().z > 0
+            && (!pos.defined() || (pos.z > 0 && !same_xy(pos, c.point())))
+        ) {
+            close(i);
+            
+            // A lone rapid opening a section is just a part of its prologue
+            if (
+                !ret.empty() && ret.back().section == section && ret.back().end == ret.back().begin + 1
+                && (ret.size() == 1 || ret[ret.size() - 2].section != section)
+            )
+                ret.pop_back();
+            
+            chain ch;
+            ch.begin = i;
+            ch.section = section;
+            ch.entry = c.point();
+            ch.feed_in = feed;
+            ret.push_back(ch);
+            in_chain = true;
+        }
+        
+        if (c.point().defined())
+            pos = c.point();
+        feed = c.feed_rate(feed);
+    }
+    close(cmds_.size());
+    
+    for (chain& ch: ret) {
+        if (same_xy(ch.entry, ch.exit)) {
+            // Nothing to gain from reversing, so it can go either way
+            ch.reversible = true;
+            continue;
+        }
+        
+        // Only plunge -> feeds -> retract chains, without any modal words inside.
+        // Everything but the retract is fed, and the retract is the only
+        // vertical move out of the last cut, since reversing turns it into
+        // the plunge and the last cut into the first one.
+        size_t m = ch.end - ch.begin - 1;
+        ch.reversible = (m >= 3);
+        for (size_t i = ch.begin + 1; i != ch.end && ch.reversible; ++i) {
+            const gcmd& c = cmds_[i];
+            ch.reversible = is_motion(c) && c.tail().empty()
+                && (i + 1 == ch.end ? c.arg() <= 1 : c.equals('G', 1));
+        }
+        ch.reversible = ch.reversible
+            && same_xy(cmds_[ch.begin + 1].point(), ch.entry)
+            && same_xy(cmds_[ch.end - 2].point(), ch.exit)
+            && !same_xy(cmds_[ch.end - 3].point(), ch.exit)
+            && ch.exit.z > 0;
+    }
+    
+    return ret;
+}
+
+void gcode::append_chain(std::vector<gcmd>& out, const chain& ch, bool reversed) const
+{
+    if (!reversed || same_xy(ch.entry, ch.exit)) {
+        out.insert(out.end(), cmds_.begin() + ch.begin, cmds_.begin() + ch.end);
+        return;
+    }
+    
+    // Points p[0] (travel target) .. p[m] (retract), walked backwards:
+    // travel above p[m-1], plunge into it, feed back to p[1], retract above it.
+    size_t m = ch.end - ch.begin - 1;
+    auto p = [this, &ch](size_t k) { return cmds_[ch.begin + k].point(); };
+    auto cmd = [this, &ch](size_t k) { return cmds_[ch.begin + k]; };
+    
+    gcmd travel = cmd(0);
+    travel.set_point({ p(m-1).x, p(m-1).y, p(0).z });
+    out.push_back(travel);
+    
+    gcmd plunge = cmd(1);
+    plunge.set_point(p(m-1));
+    out.push_back(plunge);
+    
+    for (size_t k = m - 2; k >= 1; --k) {
+        gcmd c = cmd(k + 1);
+        c.set_point(p(k));
+        out.push_back(c);
+    }
+    
+    gcmd retract = cmd(m);
+    retract.set_point({ p(1).x, p(1).y, p(m).z });
+    out.push_back(retract);
+}
+
+gcode::travel_stats gcode::optimize_travel()
+{
+    travel_stats stats = { 0, 0 };
+    std::vector<chain> all = chains();
+    
+    std::vector<gcmd> newcmds;
+    size_t copied = 0;
+    
+    for (auto first = all.begin(); first != all.end();) {
+        auto last = std::find_if(first, all.end(), [first](const chain& ch) { return ch.section != first->section; });
+        
+        // A chain left below the surface must stay right before the section end
+        auto pinned = last;
+        if ((last - 1)->exit.z <= 0)
+            --pinned;
+        
+        point start;
+        for (size_t i = first->begin; i-- > 0;) {
+            if (cmds_[i].point().defined()) {
+                start = cmds_[i].point();
+                break;
+            }
+        }
+        
+        std::vector<route_item> items;
+        for (auto i = first; i != pinned; ++i)
+            items.push_back({ i->entry, i->exit, i->reversible });
+        
+        auto route = plan_route(items, start);
+        double before = route_length(items, identity_route(items.size()), start);
+        double after = route_length(items, route, start);
+        stats.before += before;
+        stats.after += std::min(before, after);
+        
+        newcmds.insert(newcmds.end(), cmds_.begin() + copied, cmds_.begin() + first->begin);
+        
+        double feed = first->feed_in;
+        for (const route_step& step: route) {
+            const chain& ch = *(first + step.index);
+            if (!same_feed(feed, ch.feed_in) && !std::isnan(ch.feed_in))
+                newcmds.push_back(gcmd::parse(::point(), "F" + lexical_cast<std::string>(ch.feed_in)));
+            append_chain(newcmds, ch, step.reversed);
+            feed = ch.feed_out;
+        }
+        
+        double orig_feed = (pinned != last) ? pinned->feed_in : (last - 1)->feed_out;
+        if (!same_feed(feed, orig_feed) && !std::isnan(orig_feed))
+            newcmds.push_back(gcmd::parse(::point(), "F" + lexical_cast<std::string>(orig_feed)));
+        
+        copied = (pinned != last) ? pinned->begin : (last - 1)->end;
+        first = last;
+    }
+    
+    newcmds.insert(newcmds.end(), cmds_.begin() + copied, cmds_.end());
+    cmds_ = std::move(newcmds);
+    resume_point_ = 0;
+    return stats;
+}
+
+size_t gcode::fit_arcs(double tolerance)
+{
+    static const size_t MIN_SEGMENTS = 3;
+    static const size_t MAX_SEGMENTS = 256;
+    
+    std::vector<gcmd> newcmds;
+    point pos;
+    
+    for (size_t i = 0; i != cmds_.size();) {
+        const gcmd& c = cmds_[i];
+        
+        // Longest run of plain G1 moves at the current depth
+        std::vector<point> pts = { pos };
+        if (c.equals('G', 1) && pos.defined()) {
+            for (size_t j = i; j != cmds_.size() && pts.size() <= MAX_SEGMENTS; ++j) {
+                const gcmd& m = cmds_[j];
+                if (!m.equals('G', 1) || !m.point().defined() || fabs(m.point().z - pos.z) > EPSILON
+                    || same_xy(m.point(), pts.back()))
+                    break;
+                if (!m.tail().empty() && (j != i || m.tail().size() != 1 || !m.tail().count('F')))
+                    break;
+                pts.push_back(m.point());
+            }
+        }
+        
+        size_t best = 0;
+        point center;
+        bool ccw = false;
+        for (size_t last = MIN_SEGMENTS; last < pts.size(); ++last) {
+            point ctr;
+            bool dir;
+            if (!fit_arc(pts, last, tolerance, ctr, dir))
+                break;
+            best = last;
+            center = ctr;
+            ccw = dir;
+        }
+        
+        if (!best) {
+            newcmds.push_back(c);
+            if (c.point().defined())
+                pos = c.point();
+            ++i;
+            continue;
+        }
+        
+        auto f = c.tail().find('F');
+        if (f != c.tail().end())
+            newcmds.push_back(gcmd::parse(::point(), "F" + lexical_cast<std::string>(f->second)));
+        vector d = (center - pos).project_xy();
+        newcmds.push_back(gcmd(ccw ? "G3" : "G2", pts[best], { d.x, d.y, NAN }));
+        pos = pts[best];
+        i += best;
+    }
+    
+    size_t saved = cmds_.size() - newcmds.size();
+    cmds_ = std::move(newcmds);
+    resume_point_ = 0;
+    return saved;
+}
+
+void gcode::split_arcs(const std::function<double(const ::point&)>& surface, double tolerance)
+{
+    static const double SAMPLE_STEP = 0.5 /*mm*/;
+    static const size_t MAX_DEPTH = 8;
+    
+    std::vector<gcmd> newcmds;
+    point pos;
+    
+    for (const gcmd& c: cmds_) {
+        if (!(c.equals('G', 2) || c.equals('G', 3)) || !pos.defined() || !c.point().defined()) {
+            newcmds.push_back(c);
+            if (c.point().defined())
+                pos = c.point();
+            continue;
+        }
+        
+        point center = pos + vector(c.delta().x, c.delta().y, 0);
+        vector r0 = (pos - center).project_xy();
+        double sweep = arc_sweep(pos, c.point(), center, c.equals('G', 3));
+        point start = pos;
+        
+        auto at = [&](double t) {
+            vector r = r0.rotate(sweep * t);
+            return point(center.x + r.x, center.y + r.y, start.z + (c.point().z - start.z) * t);
+        };
+        
+        std::function<void(double, double, size_t)> split = [&](double t0, double t1, size_t depth) {
+            point a = at(t0), b = at(t1);
+            double sa = surface(a), sb = surface(b);
+            size_t samples = std::max<size_t>(4, size_t(fabs(sweep * (t1 - t0)) * r0.length() / SAMPLE_STEP));
+            
+            double dev = 0;
+            for (size_t k = 1; k < samples; ++k) {
+                double t = double(k) / samples;
+                dev = std::max(dev, fabs(surface(at(t0 + (t1 - t0) * t)) - (sa + (sb - sa) * t)));
+            }
+            
+            if (dev > tolerance && depth < MAX_DEPTH) {
+                split(t0, (t0 + t1) / 2, depth + 1);
+                split((t0 + t1) / 2, t1, depth + 1);
+            } else {
+                gcmd piece(c);
+                piece.set_point((t1 == 1) ? c.point() : b);
+                vector d = (center - a).project_xy();
+                piece.set_delta({ d.x, d.y, c.delta().z });
+                newcmds.push_back(piece);
+            }
+        };
+        split(0, 1, 0);
+        pos = c.point();
+    }
+    
+    cmds_ = std::move(newcmds);
+    resume_point_ = 0;
+}
+
+gcode::cleanup_stats gcode::cleanup()
+{
+    cleanup_stats stats = { 0, 0, 0 };
+    
+    // Modal words and zero-length moves
+    std::vector<gcmd> cmds;
+    double feed = NAN, speed = NAN;
+    std::set<int> modes;
+    point pos;
+    for (const gcmd& c: cmds_) {
+        if (c.letter() == 'F' || c.letter() == 'S') {
+            double& value = (c.letter() == 'F') ? feed : speed;
+            double v = lexical_cast<double>(c.str_arg());
+            if (same_feed(v, value)) {
+                ++stats.modal;
+                continue;
+            }
+            value = v;
+        } else if (c.letter() == 'G' && (c.arg() == 17 || c.arg() == 21 || c.arg() == 90 || c.arg() == 94)) {
+            if (!modes.insert(c.arg()).second) {
+                ++stats.modal;
+                continue;
+            }
+        } else if (c.letter() == 'T' || c.equals('M', 0) || c.equals('M', 6)) {
+            // Tool changes and pauses let the operator touch the machine
+            feed = speed = NAN;
+            modes.clear();
+        } else if ((c.equals('G', 0) || c.equals('G', 1)) && pos.defined() && c.point().defined()
+                   && (c.point() - pos).length() < EPSILON
+                   && std::all_of(c.tail().begin(), c.tail().end(), [](const std::pair<char, double>& w) { return w.first == 'F'; })
+                   && same_feed(c.feed_rate(feed), feed))
+        {
+            ++stats.zero_length;
+            continue;
+        }
+        
+        feed = c.feed_rate(feed);
+        auto s = c.tail().find('S');
+        if (s != c.tail().end())
+            speed = s->second;
+        if (c.point().defined())
+            pos = c.point();
+        cmds.push_back(c);
+    }
+    
+    // Cuts repeating already cut segments at the very beginning or end of
+    // a chain are dropped by moving the plunge or the retract along.
+    std::vector<gcmd> out;
+    std::vector<point> from;   // where each of `out` starts
+    std::vector<bool> dup;     // whether it repeats an earlier cut
+    std::unordered_set<segment_key, segment_hash> cut;
+    pos = point();
+    
+    auto emit = [&](const gcmd& c, bool d) {
+        out.push_back(c);
+        from.push_back(pos);
+        dup.push_back(d);
+        if (c.point().defined())
+            pos = c.point();
+    };
+    
+    for (size_t i = 0; i != cmds.size(); ++i) {
+        const gcmd& c = cmds[i];
+        bool is_dup = false;
+        if (c.equals('G', 1) && pos.defined() && c.point().defined() && is_cut(pos, c.point()))
+            is_dup = !cut.insert(make_key(pos, c.point())).second && c.tail().empty();
+        
+        if (!is_dup) {
+            emit(c, false);
+            continue;
+        }
+        point to = c.point();
+        
+        // Chain start: travel above the surface, then straight down to `pos`
+        size_t k = out.size();
+        for (; k && (is_modal_only(out[k-1])
+                     || (is_line(out[k-1]) && same_xy(out[k-1].point(), pos)
+                         && same_xy(from[k-1], pos) && from[k-1].z > out[k-1].point().z)); --k) {}
+        if (k && k != out.size() && is_line(out[k-1]) && same_xy(out[k-1].point(), pos)
+            && out[k-1].point().z > 0 && from[k-1].z > 0)
+        {
+            for (size_t m = k - 1; m != out.size(); ++m) {
+                if (is_motion(out[m]))
+                    out[m].set_point({ to.x, to.y, out[m].point().z });
+                if (m >= k)
+                    from[m] = { to.x, to.y, from[m].z };
+            }
+            pos = to;
+            ++stats.duplicates;
+            continue;
+        }
+        
+        // Chain end: straight up above the surface from `to`
+        std::vector<size_t> retract;
+        double z = to.z;
+        for (size_t m = i + 1; m != cmds.size() && z <= 0; ++m) {
+            if (is_modal_only(cmds[m]))
+                continue;
+            if (!is_line(cmds[m]) || !same_xy(cmds[m].point(), to) || cmds[m].point().z <= z)
+                break;
+            z = cmds[m].point().z;
+            retract.push_back(m);
+        }
+        if (z > 0) {
+            ++stats.duplicates;
+            while (!out.empty() && dup.back() && out.back().equals('G', 1)) {
+                pos = from.back();
+                out.pop_back();
+                from.pop_back();
+                dup.pop_back();
+                ++stats.duplicates;
+            }
+            for (size_t m: retract)
+                cmds[m].set_point({ pos.x, pos.y, cmds[m].point().z });
+            continue;
+        }
+        
+        emit(c, true);
+    }
+    
+    cmds_ = std::move(out);
+    resume_point_ = 0;
+    return stats;
+}
+
+size_t gcode::link_chains(double max_length)
+{
+    if (max_length < 0)
+        return 0;
+    
+    std::vector<gcmd> newcmds;
+    size_t count = 0;
+    point pos;
+    double feed = NAN;
+    std::vector<segment> cuts; // at the current depth, since the last retract
+    
+    for (size_t i = 0; i != cmds_.size();) {
+        const gcmd& c = cmds_[i];
+        
+        if (pos.defined() && pos.z < 0 && is_motion(c) && c.arg() <= 1
+            && same_xy(pos, c.point()) && c.point().z > pos.z)
+        {
+            // Walk over the hop: everything must stay above the cut depth,
+            // travel must happen above the surface, and a straight plunge
+            // must bring us back to the same depth.
+            point hop = pos;
+            double hop_feed = feed;
+            bool landed = false;
+            size_t j = i;
+            for (; j != cmds_.size(); ++j) {
+                const gcmd& h = cmds_[j];
+                if (h.letter() == 'F') {
+                    hop_feed = h.feed_rate(hop_feed);
+                    continue;
+                }
+                if (!is_motion(h) || h.arg() > 1)
+                    break;
+                if (!same_xy(hop, h.point()) && (hop.z <= 0 || h.point().z <= 0))
+                    break;
+                hop_feed = h.feed_rate(hop_feed);
+                hop = h.point();
+                if (hop.z <= pos.z + EPSILON) {
+                    landed = true;
+                    break;
+                }
+            }
+            
+            if (landed && fabs(hop.z - pos.z) < EPSILON) {
+                bool link = (hop - pos).project_xy().length() <= max_length;
+                if (!link) {
+                    std::vector<segment> around = cuts;
+                    point p = hop;
+                    for (size_t k = j + 1; k != cmds_.size() && cmds_[k].equals('G', 1)
+                         && fabs(cmds_[k].point().z - pos.z) < EPSILON; ++k)
+                    {
+                        around.push_back({ p, cmds_[k].point() });
+                        p = cmds_[k].point();
+                    }
+                    link = retraces(pos, hop, around);
+                }
+                
+                if (link) {
+                    // The feed the plunge would have left, unless the next move sets its own anyway
+                    newcmds.push_back(gcmd("G1", hop));
+                    bool overridden = j + 1 != cmds_.size() && !std::isnan(cmds_[j + 1].feed_rate(NAN));
+                    if (!same_feed(feed, hop_feed) && !std::isnan(hop_feed) && !overridden)
+                        newcmds.push_back(gcmd::parse(::point(), "F" + lexical_cast<std::string>(hop_feed)));
+                    cuts.push_back({ pos, hop });
+                    pos = hop;
+                    feed = hop_feed;
+                    i = j + 1;
+                    ++count;
+                    continue;
+                }
+            }
+        }
+        
+        newcmds.push_back(c);
+        feed = c.feed_rate(feed);
+        if (is_motion(c)) {
+            if (pos.defined() && c.equals('G', 1) && c.point().z < 0 && fabs(c.point().z - pos.z) < EPSILON)
+                cuts.push_back({ pos, c.point() });
+            else if (c.point().z > 0)
+                cuts.clear();
+            pos = c.point();
+        }
+        ++i;
+    }
+    
+    cmds_ = std::move(newcmds);
+    resume_point_ = 0;
+    return count;
+}
+
+size_t gcode::rapid_air_moves(const std::function<double(const ::point&)>& surface, double clearance)
+{
+    std::vector<gcmd> newcmds;
+    size_t count = 0;
+    point pos;
+    
+    for (const gcmd& c: cmds_) {
+        if (!c.equals('G', 1) || !c.point().defined() || !pos.defined()) {
+            newcmds.push_back(c);
+            if (c.point().defined())
+                pos = c.point();
+            continue;
+        }
+        
+        point from = pos, to = c.point();
+        pos = to;
+        
+        // Legs are short (see break_long_legs()), so checking
+        // both ends and the middle is enough to follow the surface
+        double level = clearance + std::max({
+            surface(from), surface(to), surface(from + (to - from) / 2)
+        });
+        
+        if (from.z >= level && to.z >= level) {
+            newcmds.push_back(c);
+            newcmds.back().set_cmd("G0");
+            ++count;
+        } else if (same_xy(from, to) && to.z > from.z) {
+            newcmds.push_back(c);
+            newcmds.back().set_cmd("G0");
+            ++count;
+        } else if (from.z > level && (from.z - level) > EPSILON) {
+            point split = from + (to - from) * ((from.z - level) / (from.z - to.z));
+            newcmds.push_back(gcmd("G0", split));
+            newcmds.push_back(c);
+            ++count;
+        } else {
+            newcmds.push_back(c);
+        }
+    }
+    
+    cmds_ = std::move(newcmds);
+    resume_point_ = 0;
+    return count;
+}
+
 ::bounding_box gcode::bounding_box() const
 {
     ::bounding_box box;
@@ -209,13 +978,21 @@ void gcode::send_to(cnc_machine& cnc, const std::string& prompt)
     bool in_tool_chg = false;
     std::string tool_chg_prompt;
     
-    interactive::progress_bar progress(prompt.empty() ? "Working" : prompt, cmds_.size());
+    // Progress is measured in milliseconds of estimated machine time
+    std::vector<size_t> weights;
+    for (double t: motion_planner(machine_limits::from(cnc)).estimate(*this, cnc.position()))
+        weights.push_back(size_t(t * 1000));
+    size_t total = std::accumulate(weights.begin(), weights.end(), size_t(0));
+    
+    interactive::progress_bar progress(prompt.empty() ? "Working" : prompt, std::max<size_t>(total, 1));
+    progress.resume_from(std::accumulate(weights.begin(), weights.begin() + resume_point_, size_t(0)));
     cnc.move_z(1);
     
     bool fast_forward = (resume_point_ != 0);
     auto i = cmds_.begin() + resume_point_, ie = cmds_.end();
     for (; i != ie; ++i) {
         const gcmd& cmd = *i;
+        size_t weight = weights[std::distance(cmds_.begin(), i)];
         
         if (cmd.letter() == 'T' || cmd.equals('M', 6)) {
             in_tool_chg = true;
@@ -253,7 +1030,7 @@ void gcode::send_to(cnc_machine& cnc, const std::string& prompt)
             cnc.send_gcmd(cmd);
         }
 
-        progress.increment();
+        progress.advance(weight);
     }
     
     std::cerr << std::endl;
@@ -5,18 +5,23 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <functional>
 #include <sstream>
 #include <cmath>
+#include <cstdlib>
 
 
 class cnc_machine;
 
 class gcmd {
 public:
-    gcmd(std::string cmd, ::point pt): cmd_(std::move(cmd)), pt_(pt) {}
+    gcmd(std::string cmd, ::point pt): cmd_(std::move(cmd)), pt_(pt), arg_(parse_arg(cmd_)) {}
+    gcmd(std::string cmd, ::point pt, ::vector delta):
+        cmd_(std::move(cmd)), pt_(pt), delta_(delta), arg_(parse_arg(cmd_)) {}
     static gcmd parse(const point& last_point, const std::string& str);
     
     const std::string& cmd() const { return cmd_; }
+    void set_cmd(std::string cmd) { cmd_ = std::move(cmd); arg_ = parse_arg(cmd_); }
     
     char letter() const { return cmd_[0]; }
     std::string str_arg() const { return cmd_.substr(1); }
@@ -25,6 +30,9 @@ public:
     
     const std::map<char, double>& tail() const { return tail_; }
     
+    // Feed rate in effect after this command, given the one before it
+    double feed_rate(double prev) const;
+    
     const ::point& point() const { return pt_; }
     void set_point(const ::point& pt);
 
@@ -40,13 +48,20 @@ public:
         if (pt_.any_defined())
             ret.pt_ = xf(pt_);
         if (delta_.any_defined()) {
-            ret.delta_ = xf(delta_ + point::zero()) - xf(point::zero());
+            ret.delta_ = xf(delta_ + ::point::zero()) - xf(::point::zero());
+            
+            // Mirroring reverses the direction of arcs
+            vector ex = xf(::point(1, 0, 0)) - xf(::point::zero()), ey = xf(::point(0, 1, 0)) - xf(::point::zero());
+            if (ex.x*ey.y - ex.y*ey.x < 0 && (equals('G', 2) || equals('G', 3)))
+                ret.set_cmd(equals('G', 2) ? "G3" : "G2");
         }
         return ret;
     }
     
 private:
     gcmd() {}
+    
+    static int parse_arg(const std::string& cmd) { return cmd.empty() ? 0 : atoi(cmd.c_str() + 1); }
 
     std::string cmd_;
     std::map<char, double> tail_;
@@ -58,12 +73,39 @@ private:
 
 class gcode {
 public:
+    // A run of commands starting with a rapid XY travel above the surface
+    // and lasting until the next such travel or a non-motion command
+    // (tool change, spindle control, message, etc). Chains within the same
+    // section may be freely reordered.
+    struct chain {
+        size_t begin, end;
+        size_t section;
+        point entry, exit;
+        double feed_in, feed_out;
+        bool reversible;
+    };
+    
+    struct travel_stats {
+        double before;
+        double after;
+    };
+    
+    struct cleanup_stats {
+        size_t modal;        // repeated F/S words and modes already in effect
+        size_t zero_length;  // moves going nowhere
+        size_t duplicates;   // cuts along already cut segments
+        
+        size_t total() const { return modal + zero_length + duplicates; }
+    };
+
     gcode();
     template<class It> gcode(It begin, It end): cmds_(begin, end), resume_point_(0) {}
     explicit gcode(std::istream&);
     
     std::vector<gcmd>::const_iterator begin() const { return cmds_.begin(); }
     std::vector<gcmd>::const_iterator end() const { return cmds_.end(); }
+    std::vector<gcmd>::iterator begin() { return cmds_.begin(); }
+    std::vector<gcmd>::iterator end() { return cmds_.end(); }
     size_t size() const { return cmds_.size(); }
     const gcmd& operator[](size_t idx) const { return cmds_[idx]; }
     
@@ -76,6 +118,39 @@ public:
     
     void break_long_legs();
     
+    // Replaces runs of G1 moves lying within `tolerance` of a circle
+    // with G2/G3 arcs; returns the number of commands saved.
+    size_t fit_arcs(double tolerance);
+    
+    // Splits arcs until the surface under each of them deviates from
+    // a straight slope between its ends by no more than `tolerance`,
+    // so that height map compensation of the ends is enough.
+    void split_arcs(const std::function<double(const ::point&)>& surface, double tolerance);
+    
+    // Removes commands having no effect on the result; returns how many
+    cleanup_stats cleanup();
+    
+    // Chains in order of appearance. Every non-motion command closes the
+    // chain before it and starts a new section, so the holes drilled with
+    // one tool (travel, plunge, retract each) come out as the chains of one
+    // section, one chain per hole, while tool changes, spindle control and
+    // messages between them always lie outside of any chain.
+    std::vector<chain> chains() const;
+    travel_stats optimize_travel();
+    
+    // Replaces retract-travel-plunge hops between cuts at the same depth
+    // with a direct feed move when the hop is no longer than `max_length`
+    // or retraces an adjacent cut; a negative `max_length` links nothing.
+    // Returns the number of hops replaced.
+    size_t link_chains(double max_length);
+    
+    // Turns feed moves staying at least `clearance` above the surface into
+    // rapids, and splits plunges into a rapid down to the clearance height
+    // followed by a feed. Straight upward retracts become rapids as well.
+    // `surface(pt)` is the surface height under `pt`.
+    // Returns the number of feed moves affected.
+    size_t rapid_air_moves(const std::function<double(const ::point&)>& surface, double clearance);
+    
     void send_to(cnc_machine& cnc, const std::string& prompt = std::string());
     
     ::bounding_box bounding_box() const;
@@ -87,6 +162,8 @@ private:
 
     gcmd_classification classify(const gcmd& c);
     
+    void append_chain(std::vector<gcmd>& out, const chain& ch, bool reversed) const;
+    
 private:
     std::vector<gcmd> cmds_;
     ssize_t resume_point_ = 0;
@@ -0,0 +1,501 @@
+#include "height_map.h"
+#include <queue>
+
+height_map::height_map(const ::bounding_box& bbox, const std::vector<circular_area>& avoid, double cell_size):
+    bbox_(bbox), avoid_(avoid)
+{
+    cell_count_x_ = unsigned(ceil(bbox.size().x / cell_size));
+    cell_count_y_ = unsigned(ceil(bbox.size().y / cell_size));
+
+    rand_.seed(1);
+    for (size_t y = 0; y != cell_count_y_ + 1; ++y)
+        for (size_t x = 0; x != cell_count_x_ + 1; ++x)
+            pts_.push_back(place(bbox.bottom_left() + vector(x*cell_size_x(), y*cell_size_y(), 0)));
+    build_roots();
+}
+
+height_map::height_map(std::istream& s)
+{
+    if (!(s >> cell_count_x_ >> cell_count_y_))
+        throw std::runtime_error("bad height map");
+    pts_.resize((cell_count_x_+1) * (cell_count_y_+1));
+    for (point& pt: pts_)
+        s >> pt.x >> pt.y >> pt.z;
+    if (!s)
+        throw std::runtime_error("bad height map");
+
+    // Older maps end here
+    std::string word;
+    while (s >> word) {
+        if (word == "bbox") {
+            point a, b;
+            s >> a.x >> a.y >> b.x >> b.y;
+            a.z = b.z = 0;
+            bbox_ = ::bounding_box(a, b);
+            build_roots();
+        } else if (word == "points") {
+            size_t count = 0;
+            s >> count;
+            for (point pt; count-- && s >> pt.x >> pt.y >> pt.z;)
+                pts_.push_back(pt);
+        } else if (word == "split") {
+            size_t n, mids[5];
+            s >> n >> mids[0] >> mids[1] >> mids[2] >> mids[3] >> mids[4];
+            if (n >= nodes_.size() || nodes_[n].children
+                || std::any_of(mids, mids + 5, [this](size_t i) { return i >= pts_.size(); }))
+                throw std::runtime_error("bad height map");
+            split(n, mids);
+        } else {
+            throw std::runtime_error("bad height map");
+        }
+        if (!s)
+            throw std::runtime_error("bad height map");
+    }
+    if (nodes_.empty())
+        build_roots();
+}
+
+void height_map::save(std::ostream& s) const
+{
+    s << cell_count_x_ << " " << cell_count_y_ << "\n";
+    size_t grid = (cell_count_x_+1) * (cell_count_y_+1);
+    for (size_t i = 0; i != grid; ++i)
+        s << pts_[i].x << " " << pts_[i].y << " " << pts_[i].z << "\n";
+    s << "bbox " << bbox_.bottom_left().x << " " << bbox_.bottom_left().y << " "
+      << bbox_.top_right().x << " " << bbox_.top_right().y << "\n";
+
+    if (pts_.size() == grid)
+        return;
+
+    s << "points " << pts_.size() - grid << "\n";
+    for (size_t i = grid; i != pts_.size(); ++i)
+        s << pts_[i].x << " " << pts_[i].y << " " << pts_[i].z << "\n";
+
+    // Splits go in the order they were made, so that node indices match when loaded
+    std::vector<std::pair<size_t, size_t>> splits;
+    for (size_t n = 0; n != nodes_.size(); ++n)
+        if (nodes_[n].children)
+            splits.push_back({ nodes_[n].children, n });
+    std::sort(splits.begin(), splits.end());
+
+    for (const auto& sp: splits) {
+        const node& lb = nodes_[sp.first + LB];
+        const node& rt = nodes_[sp.first + RT];
+        s << "split " << sp.second << " " << lb.corners[RB] << " " << rt.corners[LT] << " "
+          << lb.corners[LT] << " " << rt.corners[RB] << " " << lb.corners[RT] << "\n";
+    }
+}
+
+size_t height_map::cell_count() const
+{
+    return std::count_if(nodes_.begin(), nodes_.end(), [](const node& n) { return !n.children; });
+}
+
+// The spline is held level past the edges of the map, and so must be the
+// residual added on top of it; bilinear cells would go on sloping there
+static point clamp_to(const bounding_box& box, const point& pt)
+{
+    return point(
+        std::min(std::max(pt.x, box.bottom_left().x), box.top_right().x),
+        std::min(std::max(pt.y, box.bottom_left().y), box.top_right().y),
+        pt.z
+    );
+}
+
+point height_map::operator()(point pt) const
+{
+    if (interpolation_ == interpolation::triangulated)
+        return { pt.x, pt.y, pt.z + tin()(pt) };
+    if (interpolation_ == interpolation::bicubic) {
+        point in = clamp_to(bbox_, pt);
+        return { pt.x, pt.y, pt.z + cells()[leaf_at(in)].z(in.x, in.y) + spline(in) };
+    }
+    return { pt.x, pt.y, pt.z + cells()[leaf_at(pt)].z(pt.x, pt.y) };
+}
+
+void height_map::apply(size_t n, const double* x, const double* y, double* z) const
+{
+    if (interpolation_ == interpolation::triangulated) {
+        const triangulation& t = tin();
+        for (size_t i = 0; i != n; ++i)
+            z[i] += t(point(x[i], y[i], 0));
+        return;
+    }
+
+    // Points outside the grid belong to the nearest edge cell and
+    // are looked up every time, as they fall outside its box
+    const std::vector<cell>& c = cells();
+    bool smooth = interpolation_ == interpolation::bicubic;
+    const ::bounding_box* box = nullptr;
+    size_t leaf = 0;
+    for (size_t i = 0; i != n; ++i) {
+        point pt(x[i], y[i], 0);
+        if (smooth)
+            pt = clamp_to(bbox_, pt);
+        if (!box || pt.x < box->bottom_left().x || pt.x >= box->top_right().x
+                 || pt.y < box->bottom_left().y || pt.y >= box->top_right().y) {
+            leaf = leaf_at(pt);
+            box = &nodes_[leaf].box;
+        }
+        z[i] += c[leaf].z(pt.x, pt.y);
+        if (smooth)
+            z[i] += spline(pt);
+    }
+}
+
+const std::vector<height_map::cell>& height_map::cells() const
+{
+    if (!cells_.empty())
+        return cells_;
+
+    std::vector<point> residuals;
+    if (interpolation_ == interpolation::bicubic) {
+        residuals = pts_;
+        for (point& pt: residuals)
+            pt.z -= spline(pt);
+    }
+    const std::vector<point>& pts = residuals.empty() ? pts_ : residuals;
+    for (size_t n = 0; n != nodes_.size(); ++n)
+        cells_.push_back(make_cell(n, pts));
+    return cells_;
+}
+
+const std::vector<height_map::patch>& height_map::patches() const
+{
+    if (!patches_.empty())
+        return patches_;
+
+    // Nodes beyond the edges continue the parabola through the last three,
+    // or the slope of the last cell where there are only two
+    int nx = cell_count_x_, ny = cell_count_y_;
+    auto extend = [](int i, int n, const std::function<double(int)>& at) {
+        if (i >= 0 && i <= n)
+            return at(i);
+        int e = i < 0 ? 0 : n, d = i < 0 ? 1 : -1;
+        return n >= 2 ? 3*at(e) - 3*at(e + d) + at(e + 2*d) : 2*at(e) - at(e + d);
+    };
+    auto node_z = [&](int x, int y) {
+        return extend(x, nx, [&](int x) {
+            return extend(y, ny, [&](int y) { return pts_[y*(nx+1) + x].z; });
+        });
+    };
+
+    // Catmull-Rom basis: p(t) = [1 t t^2 t^3] * M * [p-1 p0 p1 p2]
+    static const double M[4][4] = {
+        {  0,    1,    0,    0   },
+        { -0.5,  0,    0.5,  0   },
+        {  1,   -2.5,  2,   -0.5 },
+        { -0.5,  1.5, -1.5,  0.5 }
+    };
+    for (int cy = 0; cy != ny; ++cy) {
+        for (int cx = 0; cx != nx; ++cx) {
+            double p[4][4];
+            for (int k = 0; k != 4; ++k)
+                for (int l = 0; l != 4; ++l)
+                    p[k][l] = node_z(cx - 1 + k, cy - 1 + l);
+
+            // a = M * p * M^T
+            double mp[4][4] = {};
+            for (size_t i = 0; i != 4; ++i)
+                for (size_t k = 0; k != 4; ++k)
+                    for (size_t l = 0; l != 4; ++l)
+                        mp[i][l] += M[i][k] * p[k][l];
+            patch pa = {};
+            for (size_t i = 0; i != 4; ++i)
+                for (size_t j = 0; j != 4; ++j)
+                    for (size_t l = 0; l != 4; ++l)
+                        pa.a[i][j] += mp[i][l] * M[j][l];
+            patches_.push_back(pa);
+        }
+    }
+    return patches_;
+}
+
+// The spline takes grid nodes at their nominal positions; the cells
+// make up for those shifted away from drill holes. Beyond the edges
+// of the map, it stays at the height the edge has.
+double height_map::spline(const point& pt) const
+{
+    const std::vector<patch>& p = patches();
+    double fx = std::min(std::max((pt.x - bbox_.bottom_left().x) * inv_cell_x_, 0.0), double(cell_count_x_));
+    double fy = std::min(std::max((pt.y - bbox_.bottom_left().y) * inv_cell_y_, 0.0), double(cell_count_y_));
+    size_t x = std::min(size_t(fx), size_t(cell_count_x_ - 1));
+    size_t y = std::min(size_t(fy), size_t(cell_count_y_ - 1));
+    return p[y*cell_count_x_ + x].z(fx - x, fy - y);
+}
+
+const triangulation& height_map::tin() const
+{
+    if (!tin_) {
+        std::vector<point> measured;
+        for (size_t i = 0; i != pts_.size(); ++i)
+            if (pts_[i].defined() && (i >= skipped_.size() || !skipped_[i]))
+                measured.push_back(pts_[i]);
+        tin_ = std::make_shared<triangulation>(measured);
+    }
+    return *tin_;
+}
+
+void height_map::build_roots()
+{
+    changed();
+    inv_cell_x_ = 1 / cell_size_x();
+    inv_cell_y_ = 1 / cell_size_y();
+    nodes_.clear();
+    midpoints_.clear();
+    for (size_t y = 0; y != cell_count_y_; ++y) {
+        for (size_t x = 0; x != cell_count_x_; ++x) {
+            node n;
+            point lb = bbox_.bottom_left() + vector(x*cell_size_x(), y*cell_size_y(), 0);
+            n.box = ::bounding_box(lb, lb + vector(cell_size_x(), cell_size_y(), 0));
+            n.corners[LB] = y*(cell_count_x_+1) + x;
+            n.corners[LT] = n.corners[LB] + cell_count_x_+1;
+            n.corners[RB] = n.corners[LB] + 1;
+            n.corners[RT] = n.corners[LT] + 1;
+            nodes_.push_back(n);
+        }
+    }
+}
+
+size_t height_map::root_at(const point& pt) const
+{
+    double fx = floor((pt.x - bbox_.bottom_left().x) * inv_cell_x_);
+    double fy = floor((pt.y - bbox_.bottom_left().y) * inv_cell_y_);
+    size_t x = size_t(std::min(std::max(fx, 0.0), cell_count_x_ - 1.0));
+    size_t y = size_t(std::min(std::max(fy, 0.0), cell_count_y_ - 1.0));
+    return y*cell_count_x_ + x;
+}
+
+size_t height_map::leaf_at(const point& pt) const
+{
+    size_t n = root_at(pt);
+    while (nodes_[n].children) {
+        point c = nodes_[n].box.center();
+        n = nodes_[n].children + (pt.x >= c.x ? RB : LB) + (pt.y >= c.y ? 1 : 0);
+    }
+    return n;
+}
+
+void height_map::restrict_to(const std::vector<point>& pts, const std::function<point(const point&)>& inside)
+{
+    changed();
+    used_.assign(size_t(cell_count_x_) * cell_count_y_, false);
+    for (const point& pt: pts)
+        used_[root_at(pt)] = true;
+
+    skipped_.assign((cell_count_x_+1) * (cell_count_y_+1), true);
+    for (size_t n = 0; n != used_.size(); ++n)
+        if (used_[n])
+            for (size_t c: nodes_[n].corners)
+                skipped_[c] = false;
+
+    for (size_t i = 0; i != skipped_.size(); ++i) {
+        if (skipped_[i])
+            continue;
+        point moved = inside(pts_[i]);
+        if ((moved - pts_[i]).project_xy().length() > 1e-9)
+            pts_[i] = place(moved);
+    }
+}
+
+std::vector<size_t> height_map::scan_points() const
+{
+    std::vector<size_t> ret;
+    for (size_t i = 0; i != pts_.size(); ++i)
+        if (i >= skipped_.size() || !skipped_[i])
+            ret.push_back(i);
+    return ret;
+}
+
+void height_map::fill_gaps()
+{
+    changed();
+    for (size_t i = 0; i != skipped_.size(); ++i) {
+        if (!skipped_[i])
+            continue;
+        const point* nearest = nullptr;
+        for (size_t j = 0; j != pts_.size(); ++j) {
+            if (j < skipped_.size() && skipped_[j])
+                continue;
+            if (!nearest || (pts_[j] - pts_[i]).project_xy().length() < (*nearest - pts_[i]).project_xy().length())
+                nearest = &pts_[j];
+        }
+        if (nearest)
+            pts_[i].z = nearest->z;
+    }
+}
+
+height_map::cell height_map::make_cell(size_t n, const std::vector<point>& pts) const
+{
+    const point& lb = pts[nodes_[n].corners[LB]];
+    const point& lt = pts[nodes_[n].corners[LT]];
+    const point& rb = pts[nodes_[n].corners[RB]];
+    const point& rt = pts[nodes_[n].corners[RT]];
+
+    double inv_l = 1 / (lt.y - lb.y), inv_r = 1 / (rt.y - rb.y);
+    return {
+        lb.x, lb.y, lb.z, (lt.x - lb.x) * inv_l, (lt.z - lb.z) * inv_l,
+        rb.x, rb.y, rb.z, (rt.x - rb.x) * inv_r, (rt.z - rb.z) * inv_r
+    };
+}
+
+point height_map::place(point pt)
+{
+    static const double SAFETY_MARGIN = 0.2;
+    std::uniform_real_distribution<double> rand_angle(0, 2*M_PI);
+
+    point shifted_pt = pt;
+    for (;;) {
+        auto closest = std::min_element(
+            avoid_.begin(), avoid_.end(),
+            [&shifted_pt](const circular_area& a, const circular_area& b) {
+                return a.distance_to(shifted_pt) < b.distance_to(shifted_pt);
+            }
+        );
+
+        if (closest == avoid_.end() || closest->distance_to(shifted_pt) > SAFETY_MARGIN)
+            break;
+
+        shifted_pt = pt + vector::axis::x(closest->radius + SAFETY_MARGIN + 0.05).rotate(rand_angle(rand_));
+    }
+
+    shifted_pt.z = std::numeric_limits<double>::quiet_NaN();
+    return shifted_pt;
+}
+
+void height_map::split(size_t n, const size_t mids[5])
+{
+    changed();
+    enum { B, T, L, R, C };
+    node parent = nodes_[n];
+    const size_t* c = parent.corners;
+    point lo = parent.box.bottom_left(), mid = parent.box.center(), hi = parent.box.top_right();
+
+    midpoints_[std::minmax(c[LB], c[RB])] = mids[B];
+    midpoints_[std::minmax(c[LT], c[RT])] = mids[T];
+    midpoints_[std::minmax(c[LB], c[LT])] = mids[L];
+    midpoints_[std::minmax(c[RB], c[RT])] = mids[R];
+
+    node children[4];
+    children[LB].box = ::bounding_box(lo, mid);
+    children[LT].box = ::bounding_box(point(lo.x, mid.y, 0), point(mid.x, hi.y, 0));
+    children[RB].box = ::bounding_box(point(mid.x, lo.y, 0), point(hi.x, mid.y, 0));
+    children[RT].box = ::bounding_box(mid, hi);
+
+    const size_t corners[4][4] = {
+        { c[LB], mids[L], mids[B], mids[C] },
+        { mids[L], c[LT], mids[C], mids[T] },
+        { mids[B], mids[C], c[RB], mids[R] },
+        { mids[C], mids[T], mids[R], c[RT] }
+    };
+    for (size_t i = 0; i != 4; ++i)
+        std::copy(corners[i], corners[i] + 4, children[i].corners);
+
+    nodes_[n].children = nodes_.size();
+    nodes_.insert(nodes_.end(), children, children + 4);
+}
+
+size_t height_map::midpoint(size_t a, size_t b, const point& nominal)
+{
+    auto i = midpoints_.find(std::minmax(a, b));
+    if (i != midpoints_.end())
+        return i->second;
+    pts_.push_back(place(nominal));
+    return pts_.size() - 1;
+}
+
+size_t height_map::refine(const std::function<double(const point&)>& probe, double tolerance, const std::function<bool()>& proceed)
+{
+    changed();
+    size_t probes = 0;
+    auto measure = [&](point& pt) {
+        pt.z = probe(pt);
+        ++probes;
+    };
+
+    // Leaves to split, worst first, and where the centers measured are in
+    // pts_. Centers within tolerance are kept too: they still help the
+    // triangulation, and they are there if the cell gets split later.
+    std::priority_queue<std::pair<double, size_t>> queue;
+    std::map<size_t, size_t> centers;
+
+    // Next to a drill hole, measurements get pushed about as far as the
+    // cells are wide, and splitting further would never settle
+    static const double MIN_CELL_SIZE = 2;
+    auto splittable = [&](size_t n) {
+        return std::min(nodes_[n].box.size().x, nodes_[n].box.size().y) >= MIN_CELL_SIZE * 2;
+    };
+
+    auto test = [&](size_t n) {
+        if (!splittable(n))
+            return;
+        point c = place(nodes_[n].box.center());
+        measure(c);
+        centers[n] = pts_.size();
+        pts_.push_back(c);
+        double err = fabs(c.z - interpolate(n, c));
+        if (err > tolerance)
+            queue.push({ err, n });
+    };
+
+    std::vector<size_t> leaves;
+    for (size_t n = 0; n != nodes_.size(); ++n)
+        if (!nodes_[n].children && (used_.empty() || used_[root_at(nodes_[n].box.center())]))
+            leaves.push_back(n);
+    for (size_t n: leaves) {
+        if (!proceed())
+            return probes;
+        test(n);
+    }
+
+    while (!queue.empty() && proceed()) {
+        size_t n = queue.top().second;
+        queue.pop();
+        if (nodes_[n].children)
+            continue;
+
+        node nd = nodes_[n];
+        const size_t* c = nd.corners;
+        point lo = nd.box.bottom_left(), mid = nd.box.center(), hi = nd.box.top_right();
+
+        size_t mids[5] = {
+            midpoint(c[LB], c[RB], point(mid.x, lo.y, 0)),
+            midpoint(c[LT], c[RT], point(mid.x, hi.y, 0)),
+            midpoint(c[LB], c[LT], point(lo.x, mid.y, 0)),
+            midpoint(c[RB], c[RT], point(hi.x, mid.y, 0)),
+            pts_.size()
+        };
+        auto center = centers.find(n);
+        if (center != centers.end())
+            mids[4] = center->second;
+        else
+            pts_.push_back(place(mid));
+        split(n, mids);
+
+        for (size_t m: mids)
+            if (!pts_[m].defined())
+                measure(pts_[m]);
+
+        // A neighbour not split along the shared edge interpolates straight
+        // across the new measurement there; split it too if that is too far off
+        const vector outward[4] = { vector::axis::y(-1), vector::axis::y(1), vector::axis::x(-1), vector::axis::x(1) };
+        const point nominal[4] = { point(mid.x, lo.y, 0), point(mid.x, hi.y, 0), point(lo.x, mid.y, 0), point(hi.x, mid.y, 0) };
+        for (size_t e = 0; e != 4; ++e) {
+            point q = nominal[e] + outward[e] * 1e-3;
+            if (!bbox_.contains(q))
+                continue;
+            size_t k = leaf_at(q);
+            if (!used_.empty() && !used_[root_at(q)])
+                continue;
+            if (std::count(nodes_[k].corners, nodes_[k].corners + 4, mids[e]) || !splittable(k))
+                continue;
+            double err = fabs(pts_[mids[e]].z - interpolate(k, pts_[mids[e]]));
+            if (err > tolerance)
+                queue.push({ err, k });
+        }
+
+        for (size_t i = 0; i != 4 && proceed(); ++i)
+            test(nodes_[n].children + i);
+    }
+    return probes;
+}
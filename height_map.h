@@ -1,104 +1,167 @@
 #pragma once
 
 #include "geom.h"
+#include "triangulation.h"
 #include <vector>
+#include <map>
 #include <iostream>
 #include <algorithm>
+#include <functional>
 #include <random>
+#include <memory>
 
+// Surface heights measured at the nodes of a grid. Each grid cell may
+// be split into four further measured quarters, and so on recursively.
 class height_map {
 public:
-    explicit height_map(const bounding_box& bbox, const std::vector<circular_area>& avoid): bbox_(bbox)
-    {
-        static const double SUGGESTED_CELL_SIZE = 10;
-        static const double SAFETY_MARGIN = 0.2;
-        cell_count_x_ = unsigned(ceil(bbox.size().x / SUGGESTED_CELL_SIZE));
-        cell_count_y_ = unsigned(ceil(bbox.size().y / SUGGESTED_CELL_SIZE));
-        
-        std::mt19937 rand;
-        rand.seed(1);
-        std::uniform_real_distribution<double> rand_angle(0, 2*M_PI);
-        
-        for (size_t y = 0; y != cell_count_y_ + 1; ++y) {
-            for (size_t x = 0; x != cell_count_x_ + 1; ++x) {
-                point pt = bbox.bottom_left() + vector(x*cell_size_x(), y*cell_size_y(), 0);
-                
-                point shifted_pt = pt;
-                for (;;) {
-                    auto closest = std::min_element(
-                        avoid.begin(), avoid.end(),
-                        [&shifted_pt](const circular_area& a, const circular_area& b) {
-                            return a.distance_to(shifted_pt) < b.distance_to(shifted_pt);
-                        }
-                    );
-                    
-                    if (closest == avoid.end() || closest->distance_to(shifted_pt) > SAFETY_MARGIN)
-                        break;
-                    
-                    shifted_pt = pt + vector::axis::x(closest->radius + SAFETY_MARGIN + 0.05).rotate(rand_angle(rand));
-                }
-                
-                shifted_pt.z = std::numeric_limits<double>::quiet_NaN();
-                pts_.push_back(shifted_pt);
-            }
-        }
-    }
-    
-    explicit height_map(std::istream& s)
-    {
-        if (!(s >> cell_count_x_ >> cell_count_y_))
-            throw std::runtime_error("bad height map");
-        pts_.resize((cell_count_x_+1) * (cell_count_y_+1));
-        for (point& pt: pts_)
-            s >> pt.x >> pt.y >> pt.z;
-        if (!s)
-            throw std::runtime_error("bad height map");
-    }
-    
-    void save(std::ostream& s) const
-    {
-        s << cell_count_x_ << " " << cell_count_y_ << "\n";
-        for (const point& pt: pts_)
-            s << pt.x << " " << pt.y << " " << pt.z << "\n";
-    }
+    static constexpr double SUGGESTED_CELL_SIZE = 10;
+
+    enum class interpolation {
+        bilinear,     // within grid cells
+        triangulated, // linear over a Delaunay triangulation of all the measurements
+        bicubic       // Catmull-Rom spline through the grid nodes, with refinements added bilinearly
+    };
+
+    height_map(const bounding_box& bbox, const std::vector<circular_area>& avoid, double cell_size = SUGGESTED_CELL_SIZE);
+    explicit height_map(std::istream& s);
+
+    void save(std::ostream& s) const;
 
     const ::bounding_box& bounding_box() const { return bbox_; }
-    
-    point& measurement(size_t x, size_t y) { return pts_[y*(cell_count_x_+1) + x]; }
+    void set_bounding_box(const ::bounding_box& bbox) { bbox_ = bbox; build_roots(); }
+
+    unsigned cell_count_x() const { return cell_count_x_; }
+    unsigned cell_count_y() const { return cell_count_y_; }
+    double cell_size_x() const { return bbox_.size().x / cell_count_x_; }
+    double cell_size_y() const { return bbox_.size().y / cell_count_y_; }
+
+    point& measurement(size_t x, size_t y) { changed(); return pts_[y*(cell_count_x_+1) + x]; }
     const point& measurement(size_t x, size_t y) const { return pts_[y*(cell_count_x_+1) + x]; }
-    
-    std::vector<point>::iterator begin() { return pts_.begin(); }
+
+    // All measurements, grid nodes first
+    std::vector<point>::iterator begin() { changed(); return pts_.begin(); }
     std::vector<point>::iterator end() { return pts_.end(); }
 
     bool defined() const { return std::all_of(pts_.begin(), pts_.end(), [](const point& pt) { return pt.defined(); }); }
 
-    point operator()(point pt) const
-    {
-        unsigned x = unsigned(floor((pt.x - bbox_.bottom_left().x) / cell_size_x()));
-        unsigned y = unsigned(floor((pt.y - bbox_.bottom_left().y) / cell_size_y()));
-        
-        if (x == cell_count_x_)
-            --x;
-        if (y == cell_count_y_)
-            --y;
-        
-        point lb = measurement(x, y);
-        point lt = measurement(x, y+1);
-        point rb = measurement(x+1, y);
-        point rt = measurement(x+1, y+1);
-        
-        point l = lb + (lt - lb) * ((pt.y - lb.y) / (lt.y - lb.y));
-        point r = rb + (rt - rb) * ((pt.y - rb.y) / (rt.y - rb.y));
-        point m = l + (r - l) * ((pt.x - l.x) / (r.x - l.x));
-        
-        return { pt.x, pt.y, pt.z + m.z };
-    }
-    
+    // Whether some cells are split, so that the grid nodes alone
+    // no longer describe the surface
+    bool refined() const { return nodes_.size() > size_t(cell_count_x_) * cell_count_y_; }
+    size_t cell_count() const;
+
+    interpolation interpolation_mode() const { return interpolation_; }
+    void set_interpolation(interpolation i) { interpolation_ = i; changed(); }
+
+    // Interpolation within a cell. Its corners may be shifted off the
+    // nominal cell, so the left and right edges are lerped at `y` first,
+    // then the result is lerped across at `x`. Edge slopes are worked out
+    // in advance, which leaves a single division per lookup.
+    struct cell {
+        double lx, ly, lz, ldx, ldz;  // bottom left corner; change of x and z per unit of y along the left edge
+        double rx, ry, rz, rdx, rdz;  // same for the right edge
+
+        double z(double x, double y) const
+        {
+            double ex = lx + ldx*(y - ly), ez = lz + ldz*(y - ly);
+            double fx = rx + rdx*(y - ry), fz = rz + rdz*(y - ry);
+            return ez + (fz - ez) * ((x - ex) / (fx - ex));
+        }
+    };
+
+    // Coefficients of grid cell (x, y); only meaningful for
+    // bilinear interpolation over a grid that is not refined()
+    const cell& grid_cell(size_t x, size_t y) const { return cells()[y*cell_count_x_ + x]; }
+
+    double inv_cell_size_x() const { return inv_cell_x_; }
+    double inv_cell_size_y() const { return inv_cell_y_; }
+
+    point operator()(point pt) const;
+
+    // Adds the surface height at (x[i], y[i]) to z[i] for all i < n.
+    // Consecutive points of a toolpath mostly stay within one cell,
+    // which is then only looked up once.
+    void apply(size_t n, const double* x, const double* y, double* z) const;
+
+    // Leaves out the grid nodes of cells none of `pts` fall into, and moves
+    // the remaining ones with `inside` into the area that can be probed.
+    // Refinement then stays within the cells left.
+    void restrict_to(const std::vector<point>& pts, const std::function<point(const point&)>& inside);
+
+    // Indices of the measurements to take, all grid nodes unless restricted
+    std::vector<size_t> scan_points() const;
+
+    // Moves `pt` away from areas to avoid, leaving its height undefined
+    point place(point pt);
+
+    // Gives nodes left out the height of the nearest measured one
+    void fill_gaps();
+
+    // Adaptive scan: measures the center of each cell and splits the cells
+    // whose bilinear prediction there is off by more than `tolerance`,
+    // worst first, then does the same for their quarters. Cells along
+    // which a neighbour's split edge bends too much are split as well.
+    // Cells narrower than 4 mm are left as they are. Centers close enough
+    // to the prediction are kept as measurements of their own, which only
+    // triangulated interpolation makes use of.
+    // Stops once `proceed()` returns false; returns the number of probes.
+    size_t refine(const std::function<double(const point&)>& probe, double tolerance, const std::function<bool()>& proceed);
+
 private:
+    enum corner { LB, LT, RB, RT };
+
+    struct node {
+        ::bounding_box box;   // nominal; measurements may be shifted off it
+        size_t corners[4];    // indices into pts_
+        size_t children = 0;  // index of the first of four, in corner order; 0 for leaves
+    };
+
+    // Bicubic polynomial over a grid cell, in coordinates running
+    // from 0 to 1 across it: z = sum of a[i][j] * u^i * v^j
+    struct patch {
+        double a[4][4];
+
+        double z(double u, double v) const
+        {
+            double r[4];
+            for (size_t i = 0; i != 4; ++i)
+                r[i] = ((a[i][3]*v + a[i][2])*v + a[i][1])*v + a[i][0];
+            return ((r[3]*u + r[2])*u + r[1])*u + r[0];
+        }
+    };
+
+    void build_roots();
+    void changed() { tin_.reset(); cells_.clear(); patches_.clear(); }
+    // In bicubic mode, cells interpolate what the spline misses at each measurement
+    const std::vector<cell>& cells() const;
+    const std::vector<patch>& patches() const;
+    double spline(const point& pt) const;
+    const triangulation& tin() const;
+    cell make_cell(size_t n, const std::vector<point>& pts) const;
+    double interpolate(size_t n, const point& pt) const { return make_cell(n, pts_).z(pt.x, pt.y); }
+    size_t root_at(const point& pt) const;
+    size_t leaf_at(const point& pt) const;
+
+    // Splits leaf `n` with measurement points at the middles of its
+    // bottom, top, left and right edges and at its center
+    void split(size_t n, const size_t mids[5]);
+    // Point between corners `a` and `b`, added unless a split neighbour has one
+    size_t midpoint(size_t a, size_t b, const point& nominal);
+
     ::bounding_box bbox_;
     unsigned cell_count_x_, cell_count_y_;
+    double inv_cell_x_, inv_cell_y_;
     std::vector<point> pts_;
-            
-    double cell_size_x() const { return bbox_.size().x / cell_count_x_; }
-    double cell_size_y() const { return bbox_.size().y / cell_count_y_; }
+    std::vector<node> nodes_;
+    std::map<std::pair<size_t, size_t>, size_t> midpoints_;
+    std::vector<bool> used_;     // per grid cell; empty if all are
+    std::vector<bool> skipped_;  // per grid node
+
+    interpolation interpolation_ = interpolation::bilinear;
+    // Built on first lookup; dropped whenever measurements may change
+    mutable std::vector<cell> cells_;  // per node
+    mutable std::vector<patch> patches_;  // per grid cell
+    mutable std::shared_ptr<const triangulation> tin_;
+
+    std::vector<circular_area> avoid_;
+    std::mt19937 rand_;
 };
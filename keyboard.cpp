@@ -160,7 +160,7 @@ public:
         } else if (k == key::page_down) {
             cnc_->move_z(cnc_->position().z - g_feed_z, mode_);
         } else if (k == key::p) {
-            cnc_->move_z(cnc_->probe(), cnc_machine::move_mode::unsafe);
+            cnc_->move_z(cnc_->probe().z, cnc_machine::move_mode::unsafe);
         } else if (k == key::multiplies) {
             g_feed_z *= FEED_RATE;
         } else if (k == key::divides) {
@@ -418,9 +418,9 @@ void progress_bar::update()
     int filled_width = bar_width * cur_ / max_;
     std::cerr << std::string(filled_width, '#') << std::string(bar_width - filled_width, '.') << "] ";
     
-    if (cur_) {
+    if (cur_ > start_) {
         ssize_t elapsed = time(0) - started_at_;
-        ssize_t t = elapsed * (max_ - cur_) / cur_;
+        ssize_t t = elapsed * (max_ - cur_) / (cur_ - start_);
         std::cerr << std::setfill(' ') << std::setw(3) << (t / 3600) << ':'
                   << std::setfill('0') << std::setw(2) << ((t % 3600) / 60) << ':'
                   << std::setfill('0') << std::setw(2) << (t % 60);
@@ -89,12 +89,16 @@ public:
     progress_bar& operator = (const progress_bar&) = delete;
     
     void set(size_t value) { cur_ = value; update(); }
+    // Starts from `value` already done; the estimate only counts progress from there
+    void resume_from(size_t value) { cur_ = start_ = value; update(); }
     void increment() { ++cur_; update(); }
+    void advance(size_t n) { cur_ += n; update(); }
     
 private:
     std::string prompt_;
     size_t max_;
     size_t cur_;
+    size_t start_ = 0;
     time_t started_at_;
     time_t last_updated_at_;
     
@@ -231,6 +231,12 @@ int main(int argc, char** argv)
                 pts.push_back(d.center);
                 dias.push_back("dia=" + std::to_string(d.radius * 2));
             }
+            const auto& travel = w->drill_travel();
+            if (travel.before > 0) {
+                std::cout << "Planned order; " << w->drill_tools_merged() << " tool changes merged; "
+                          << "travel " << std::fixed << std::setprecision(1) << travel.before << " mm -> "
+                          << travel.after << " mm (" << travel.before - travel.after << " mm saved)" << std::endl;
+            }
             interactive::point_list(cnc, xform(pts), dias).show("Drills");
         };
         
@@ -238,18 +244,34 @@ int main(int argc, char** argv)
         COMMAND("run drill") { w->drill(); };
         COMMAND("run mill") { w->mill(); };
         COMMAND("run hmap+mill") {
-            w->scan_height_map();
-            w->mill();
+            if (settings::g_params.hmap_lazy) {
+                w->scan_and_mill();
+            } else {
+                w->scan_height_map();
+                w->mill();
+            }
         };
         COMMAND("run cut") { w->cut(); };
         COMMAND("resume") { w->resume(); };
+        COMMAND("estimate", const std::string& layer) { w->estimate(layer); };
         
         COMMAND("dump mill", const std::string& filename) { w->dump_mill(filename); };
         
         COMMAND("hmap scan") { w->scan_height_map(); };
+        COMMAND("hmap verify") { w->verify_height_map(); };
         COMMAND("hmap load", const std::string& filename) { w->load_height_map(filename); };
         COMMAND("hmap save", const std::string& filename) { w->save_height_map(filename); };
         COMMAND("hmap zero") { w->zero_height_map(); };
+        COMMAND("hmap interpolation", const std::string& mode) {
+            if (mode == "bilinear")
+                w->set_interpolation(height_map::interpolation::bilinear);
+            else if (mode == "triangulated")
+                w->set_interpolation(height_map::interpolation::triangulated);
+            else if (mode == "bicubic")
+                w->set_interpolation(height_map::interpolation::bicubic);
+            else
+                throw std::runtime_error("unknown interpolation: " + mode);
+        };
         
         COMMAND("spindle on") { cnc.set_spindle_on(); };
         COMMAND("spindle off") { cnc.set_spindle_off(); };
@@ -268,31 +290,129 @@ int main(int argc, char** argv)
         COMMAND("set z_adjust", double z) { w->adjust_z(z); };
         COMMAND("set probe_height", double h) { probe_height = h; };
         COMMAND("set move_orient", bool b) { move_orient = b; };
+        COMMAND("set cleanup_gcode", bool b) { settings::g_params.cleanup_gcode = b; };
+        COMMAND("set arc_tolerance", double t) { settings::g_params.arc_tolerance = t; };
+        COMMAND("set optimize_travel", bool b) { settings::g_params.optimize_travel = b; };
+        COMMAND("set link_distance", double d) { settings::g_params.link_distance = d; };
+        COMMAND("set rapid_air_moves", bool b) { settings::g_params.rapid_air_moves = b; };
+        COMMAND("set air_clearance", double h) { settings::g_params.air_clearance = h; };
+        COMMAND("set hmap_tolerance", double t) { settings::g_params.hmap_tolerance = t; };
+        COMMAND("set hmap_cell_size", double mm) {
+            if (!(mm > 0))
+                throw std::runtime_error("cell size must be positive");
+            settings::g_params.hmap_cell_size = mm;
+        };
+        COMMAND("set hmap_plane_tolerance", double t) { settings::g_params.hmap_plane_tolerance = t; };
+        COMMAND("set hmap_sparse", bool b) { settings::g_params.hmap_sparse = b; };
+        COMMAND("set hmap_lazy", bool b) { settings::g_params.hmap_lazy = b; };
+        COMMAND("set hmap_verify_tolerance", double t) { settings::g_params.hmap_verify_tolerance = t; };
+        COMMAND("set probe_clearance", double h) { settings::g_params.probe_clearance = h; };
+        COMMAND("set probe_margin", double h) { settings::g_params.probe_margin = h; };
+        COMMAND("set stream_probes", bool b) { settings::g_params.stream_probes = b; };
+        COMMAND("set probe_seek", double feed, double backoff) {
+            settings::g_params.probe_seek_feed = feed;
+            settings::g_params.probe_backoff = backoff;
+        };
+        COMMAND("set hmap_budget", size_t probes, double minutes) {
+            settings::g_params.hmap_max_probes = probes;
+            settings::g_params.hmap_max_time = minutes * 60;
+        };
        
         depth_list shape_depths;
+        bool shape_ramp = false;
         
         double tool_width = 5;
-        auto mill_shape = [&](polyline shape) {
-            polyline layered = shape_depths(std::move(shape));
-            auto pos = cnc.position();
+        double stepover = 0.5;
+        vector shape_offset = vector::zero();
+        
+        // Commands cutting `parts` placed at `origin`, each part
+        // entered and left at z=1 so that parts form separate chains
+        auto compile_shape = [&](const std::vector<shapes::path>& parts, const point& origin) {
+            auto xf = [o = orient(), off = shape_offset, d = origin.to_vector().project_xy()](point pt){ return o(pt + off) + d; };
 
             std::vector<gcmd> gcmds;
-            for (const point& pt: layered)
-                gcmds.push_back(gcmd("G1", pt));
+            for (const shapes::path& part: parts) {
+                shapes::path layered = shape_ramp ? shape_depths.ramp(part) : shape_depths(part);
+                
+                // Arcs go out as G2/G3 unless the transform would distort them
+                if (!shapes::preserves_arcs(xf))
+                    layered = shapes::path(layered.flatten());
+                
+                point to = layered.start();
+                gcmds.push_back(gcmd("G0", point(to.x, to.y, 1)));
+                std::vector<gcmd> cmds = layered.commands();
+                gcmds.insert(gcmds.end(), cmds.begin(), cmds.end());
+                point from = gcmds.back().point();
+                gcmds.push_back(gcmd("G0", point(from.x, from.y, 1)));
+            }
             gcode gc(gcmds.begin(), gcmds.end());
+            if (settings::g_params.arc_tolerance > 0 && shapes::preserves_arcs(xf))
+                gc.fit_arcs(settings::g_params.arc_tolerance);
             gc.break_long_legs();
-            gc.xform_by([o = orient(), d = cnc.position().to_vector().project_xy()](point pt){ return o(pt) + d; });
-            
+            gc.xform_by(xf);
+            return gc;
+        };
+        
+        auto cut_shapes = [&](const gcode& gc) {
+            auto pos = cnc.position();
             cnc.move_xy(gc.frontpt());
             cnc.set_spindle_on();
             cnc.dwell(2);
-            gc.send_to(cnc);
+            gcode(gc).send_to(cnc);
             
             cnc.set_spindle_off();
             if (cnc.position().z < 1)
                 cnc.move_z(1);
             cnc.move(pos);
         };
+        
+        // While a batch is open, shapes are queued relative to its origin
+        // instead of being cut right away
+        point batch_origin;
+        std::vector<gcmd> batch;
+        size_t batch_shapes = 0;
+        
+        auto mill_shape = [&](std::vector<shapes::path> parts) {
+            if (!batch_origin.defined()) {
+                cut_shapes(compile_shape(parts, cnc.position()));
+                return;
+            }
+            gcode gc = compile_shape(parts, batch_origin);
+            batch.insert(batch.end(), gc.begin(), gc.end());
+            std::cout << ++batch_shapes << " shapes queued" << std::endl;
+        };
+        // Offsets only place shapes within a batch and end with it
+        auto close_batch = [&]{
+            batch_origin = point();
+            batch.clear();
+            shape_offset = vector::zero();
+        };
+        COMMAND("shape offset", double x, double y) {
+            if (!batch_origin.defined())
+                throw std::runtime_error("no shape batch open");
+            shape_offset = vector(x, y, 0);
+        };
+        COMMAND("shape batch") {
+            close_batch();
+            batch_origin = cnc.position();
+            batch_shapes = 0;
+        };
+        COMMAND("shape batch cancel") { close_batch(); };
+        COMMAND("shape batch run") {
+            if (!batch_origin.defined() || batch.empty())
+                throw std::runtime_error("no shapes queued");
+            gcode gc(batch.begin(), batch.end());
+            if (settings::g_params.optimize_travel) {
+                auto stats = gc.optimize_travel();
+                std::cerr << "Travel distance: " << std::fixed << std::setprecision(1)
+                          << stats.before << " mm -> " << stats.after << " mm; "
+                          << stats.before - stats.after << " mm saved" << std::endl;
+            }
+            if (cnc.position().z < 1)
+                cnc.move_z(1);
+            cut_shapes(gc);
+            close_batch();
+        };
         COMMAND("set shape_depth", double d) { shape_depths = depth_list(d); };
         COMMAND("set shape_depth", double d1, double d2, double step) {
             shape_depths = depth_list(d1, d2, step);
@@ -300,16 +420,26 @@ int main(int argc, char** argv)
             for (double d: shape_depths.depths())
                 std::cout << std::fixed << std::setprecision(2) << d << "; ";
         };
+        COMMAND("set shape_ramp", bool b) { shape_ramp = b; };
         
         COMMAND("set tool_width", double w) { tool_width = w; };
+        COMMAND("set stepover", double s) { stepover = s; };
 
-        COMMAND("shape segment", double w, double h) { mill_shape(shapes::segment({ w, h, 0 })); };
-        COMMAND("shape circle", double r) { mill_shape(shapes::circle(r)); };
-        COMMAND("shape fillcircle", double r) { mill_shape(shapes::filled_circle(0, r, tool_width)); };
-        COMMAND("shape fillcircle", double r1, double r2) { mill_shape(shapes::filled_circle(r1, r2, tool_width)); };
-        COMMAND("shape box", double w, double h) { mill_shape(shapes::box(w, h)); };
-        COMMAND("shape box", double w, double h, double r) { mill_shape(shapes::box(w, h, r)); };
-        COMMAND("shape fillbox", double w, double h) { mill_shape(shapes::filled_box(w, h, tool_width)); };
+        COMMAND("shape segment", double w, double h) { mill_shape({ shapes::segment({ w, h, 0 }) }); };
+        COMMAND("shape circle", double r) { mill_shape({ shapes::circle(r) }); };
+        COMMAND("shape fillcircle", double r) { mill_shape(shapes::filled_circle(0, r, tool_width, tool_width * stepover)); };
+        COMMAND("shape fillcircle", double r1, double r2) {
+            mill_shape(shapes::filled_circle(r1, r2, tool_width, tool_width * stepover));
+        };
+        COMMAND("shape box", double w, double h) { mill_shape({ shapes::box(w, h) }); };
+        COMMAND("shape box", double w, double h, double r) { mill_shape({ shapes::box(w, h, r) }); };
+        COMMAND("shape fillbox", double w, double h) { mill_shape(shapes::filled_box(w, h, tool_width, tool_width * stepover)); };
+        COMMAND("shape pocket", const std::string& filename) {
+            std::ifstream f(filename);
+            if (!f)
+                throw std::runtime_error("cannot open " + filename);
+            mill_shape(shapes::pocket(shapes::outline(gcode(f)), tool_width, tool_width * stepover));
+        };
                 
         impl::command_list::instance() << std::make_unique<gcode_command>(w);
 
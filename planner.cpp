@@ -0,0 +1,175 @@
+#include "planner.h"
+#include "gcode.h"
+#include "cnc.h"
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+namespace {
+
+static const double EPSILON = 1e-6;
+static const double UNLIMITED = std::numeric_limits<double>::infinity();
+static const double MINUTE = 60 /*s*/;
+
+// Time (in minutes) to travel `length` accelerating from sqrt(v0sqr)
+// to at most `nominal` and decelerating to sqrt(v1sqr)
+double profile_time(double v0sqr, double v1sqr, double nominal, double accel, double length)
+{
+    if (!std::isfinite(nominal))
+        return 0;
+    if (!std::isfinite(accel))
+        return length / nominal;
+
+    double nsqr = nominal * nominal;
+    v0sqr = std::min(v0sqr, nsqr);
+    v1sqr = std::min(v1sqr, nsqr);
+
+    double accel_dist = (nsqr - v0sqr) / (2*accel);
+    double decel_dist = (nsqr - v1sqr) / (2*accel);
+    if (accel_dist + decel_dist <= length)
+        return (nominal - sqrt(v0sqr)) / accel + (nominal - sqrt(v1sqr)) / accel
+            + (length - accel_dist - decel_dist) / nominal;
+
+    // Triangular profile: never reaches the nominal speed
+    double peak = sqrt((2*accel*length + v0sqr + v1sqr) / 2);
+    return (peak - sqrt(v0sqr)) / accel + (peak - sqrt(v1sqr)) / accel;
+}
+
+} // namespace
+
+
+machine_limits machine_limits::from(cnc_machine& cnc)
+{
+    return { cnc.max_rate(), cnc.acceleration(), cnc.junction_deviation() };
+}
+
+double motion_planner::axis_limited(const vector& unit, const vector& limits) const
+{
+    double ret = UNLIMITED;
+    if (fabs(unit.x) > EPSILON && limits.x > 0)
+        ret = std::min(ret, limits.x / fabs(unit.x));
+    if (fabs(unit.y) > EPSILON && limits.y > 0)
+        ret = std::min(ret, limits.y / fabs(unit.y));
+    if (fabs(unit.z) > EPSILON && limits.z > 0)
+        ret = std::min(ret, limits.z / fabs(unit.z));
+    return ret;
+}
+
+std::vector<double> motion_planner::estimate(const gcode& gc, const point& start) const
+{
+    std::vector<double> times(gc.size(), 0);
+    std::vector<block> blocks;
+
+    point pos = start;
+    vector prev_exit;
+    double prev_nominal = 0, prev_accel = 0;
+    double feed = NAN;
+    vector accel_limits = limits_.acceleration * MINUTE * MINUTE;
+
+    auto flush = [&]() {
+        plan(blocks, times);
+        blocks.clear();
+        prev_exit = vector();
+    };
+
+    for (size_t i = 0; i != gc.size(); ++i) {
+        const gcmd& c = gc[i];
+        feed = c.feed_rate(feed);
+
+        if (c.letter() == 'G' && c.arg() >= 0 && c.arg() <= 3 && c.point().defined()) {
+            point target = c.point();
+            if (!pos.defined()) {
+                pos = target;
+                continue;
+            }
+
+            block b;
+            b.cmd = i;
+            vector entry, exit;
+
+            if (c.arg() >= 2 && !std::isnan(c.delta().x) && !std::isnan(c.delta().y)) {
+                point center = pos + vector(c.delta().x, c.delta().y, 0);
+                vector r0 = (pos - center).project_xy(), r1 = (target - center).project_xy();
+                double radius = r0.length();
+                double dir = (c.arg() == 3) ? 1 : -1;
+
+                double sweep = dir * r0.angle_to(r1);
+                if (sweep <= EPSILON)
+                    sweep += 2*M_PI;
+                double dz = target.z - pos.z;
+                b.length = sqrt(radius*sweep*radius*sweep + dz*dz);
+
+                vector lift = vector::axis::z(dz / b.length);
+                entry = r0.unit().rotate(dir * M_PI/2) * (radius*sweep / b.length) + lift;
+                exit = r1.unit().rotate(dir * M_PI/2) * (radius*sweep / b.length) + lift;
+
+                double xy_accel = std::min(accel_limits.x, accel_limits.y);
+                b.acceleration = xy_accel;
+                b.nominal_speed = std::min({ limits_.max_rate.x, limits_.max_rate.y, sqrt(xy_accel * radius) });
+            } else {
+                vector v = target - pos;
+                b.length = v.length();
+                if (b.length > EPSILON)
+                    entry = exit = v / b.length;
+                b.acceleration = axis_limited(entry, accel_limits);
+                b.nominal_speed = axis_limited(entry, limits_.max_rate);
+            }
+
+            pos = target;
+            if (b.length < EPSILON)
+                continue;
+
+            if (c.arg() != 0 && !std::isnan(feed))
+                b.nominal_speed = std::min(b.nominal_speed, feed);
+
+            double junction_sqr = 0;
+            if (prev_exit.defined()) {
+                double cos_theta = -(prev_exit * entry);
+                if (cos_theta < -0.999999) {
+                    junction_sqr = UNLIMITED;
+                } else if (cos_theta <= 0.999999) {
+                    double sin_theta_d2 = sqrt(0.5 * (1 - cos_theta));
+                    junction_sqr = std::min(prev_accel, b.acceleration) * limits_.junction_deviation
+                        * sin_theta_d2 / (1 - sin_theta_d2);
+                }
+                junction_sqr = std::min(junction_sqr, prev_nominal * prev_nominal);
+            }
+            b.max_entry_sqr = std::min(junction_sqr, b.nominal_speed * b.nominal_speed);
+
+            blocks.push_back(b);
+            prev_exit = exit;
+            prev_nominal = b.nominal_speed;
+            prev_accel = b.acceleration;
+
+        } else if (c.equals('G', 4)) {
+            flush();
+            auto p = c.tail().find('P');
+            if (p != c.tail().end())
+                times[i] = p->second;
+        } else if (c.letter() == 'M') {
+            // Spindle control and program pauses drain Grbl's planner
+            flush();
+        }
+    }
+
+    flush();
+    return times;
+}
+
+void motion_planner::plan(const std::vector<block>& blocks, std::vector<double>& times) const
+{
+    double entry_sqr = 0;
+    for (size_t i = 0; i != blocks.size(); ++i) {
+        const block& b = blocks[i];
+
+        // Grbl must be able to stop at the end of what it has buffered
+        size_t last = std::min(blocks.size(), i + BUFFER_SIZE) - 1;
+        double exit_sqr = 0;
+        for (size_t k = last; k > i; --k)
+            exit_sqr = std::min(blocks[k].max_entry_sqr, exit_sqr + 2 * blocks[k].acceleration * blocks[k].length);
+
+        exit_sqr = std::min(exit_sqr, entry_sqr + 2 * b.acceleration * b.length);
+        times[b.cmd] += profile_time(entry_sqr, exit_sqr, b.nominal_speed, b.acceleration, b.length) * MINUTE;
+        entry_sqr = exit_sqr;
+    }
+}
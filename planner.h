@@ -0,0 +1,42 @@
+#pragma once
+
+#include "geom.h"
+#include <vector>
+
+class gcode;
+class cnc_machine;
+
+struct machine_limits {
+    vector max_rate;            // mm/min, $110..$112
+    vector acceleration;        // mm/s^2, $120..$122
+    double junction_deviation;  // mm, $11
+
+    static machine_limits from(cnc_machine& cnc);
+};
+
+// Replays a job through a model of Grbl's planner: trapezoidal velocity
+// profiles, junction deviation cornering and a lookahead limited to
+// Grbl's block buffer, to estimate how long each command takes to run.
+class motion_planner {
+public:
+    static const size_t BUFFER_SIZE = 16;
+
+    explicit motion_planner(const machine_limits& limits): limits_(limits) {}
+
+    // Estimated run time of each command of `gc`, in seconds
+    std::vector<double> estimate(const gcode& gc, const point& start = point()) const;
+
+private:
+    struct block {
+        size_t cmd;
+        double length;         // mm
+        double nominal_speed;  // mm/min
+        double acceleration;   // mm/min^2
+        double max_entry_sqr;  // (mm/min)^2
+    };
+
+    machine_limits limits_;
+
+    double axis_limited(const vector& unit, const vector& limits) const;
+    void plan(const std::vector<block>& blocks, std::vector<double>& times) const;
+};
@@ -0,0 +1,355 @@
+#include "shapes.h"
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <limits>
+#include <stdexcept>
+
+namespace shapes {
+
+namespace {
+
+static const size_t MAX_NODES = 250000;
+static const double SIMPLIFY_TOLERANCE = 0.005 /*mm*/;
+static const size_t NONE = size_t(-1);
+static const double EPSILON = 1e-6;
+
+double distance_xy(const point& p, const point& a, const point& b)
+{
+    vector ab = (b - a).project_xy();
+    double len2 = ab * ab;
+    double t = (len2 > 0) ? std::min(1.0, std::max(0.0, ((p - a).project_xy() * ab) / len2)) : 0;
+    return (p - (a + ab * t)).project_xy().length();
+}
+
+// Distance to the nearest boundary segment at grid nodes, negative outside.
+// Loops are combined with the even-odd rule, so inner loops make holes.
+//
+// Nodes next to the boundary measure the distance to segments passing by;
+// every other node gets it by trying segments nearest to its neighbours
+// in raster scans back and forth, which is linear in the number of nodes.
+class distance_field {
+public:
+    distance_field(const std::vector<polyline>& loops, double step)
+    {
+        bounding_box box;
+        for (const polyline& loop: loops) {
+            for (size_t i = 0; i != loop.size(); ++i) {
+                box.extend(loop[i]);
+                segments_.push_back({ loop[i], loop[(i + 1) % loop.size()] });
+            }
+        }
+        if (segments_.empty())
+            throw std::runtime_error("empty pocket boundary");
+
+        vector size = box.size();
+        h_ = std::max(step, sqrt(size.x * size.y / MAX_NODES));
+        origin_ = box.bottom_left() - vector(2*h_, 2*h_, 0);
+        nx_ = size_t(ceil(size.x / h_)) + 5;
+        ny_ = size_t(ceil(size.y / h_)) + 5;
+        v_.assign(nx_ * ny_, std::numeric_limits<double>::infinity());
+        nearest_.assign(nx_ * ny_, NONE);
+
+        seed();
+        for (int pass = 0; pass != 2; ++pass) {
+            for (size_t j = 0; j != ny_; ++j)
+                for (size_t i = 0; i != nx_; ++i)
+                    propagate(i, j, { { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 } });
+            for (size_t j = ny_; j-- > 0;)
+                for (size_t i = nx_; i-- > 0;)
+                    propagate(i, j, { { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 } });
+        }
+
+        std::vector<bool> inside(nx_ * ny_, false);
+        for (size_t j = 0; j != ny_; ++j) {
+            for (const auto& span: inside_spans(origin_.y + j*h_)) {
+                size_t i0 = size_t(std::max(0.0, ceil((span.first - origin_.x) / h_)));
+                size_t i1 = size_t(std::max(0.0, floor((span.second - origin_.x) / h_)));
+                for (size_t i = i0; i <= i1 && i < nx_; ++i)
+                    inside[j*nx_ + i] = true;
+            }
+        }
+        for (size_t k = 0; k != v_.size(); ++k)
+            if (!inside[k])
+                v_[k] = -v_[k];
+    }
+
+    size_t nx() const { return nx_; }
+    size_t ny() const { return ny_; }
+    double step() const { return h_; }
+    double operator()(size_t i, size_t j) const { return v_[j*nx_ + i]; }
+    point node(size_t i, size_t j) const { return origin_ + vector(i*h_, j*h_, 0); }
+    double max() const { return *std::max_element(v_.begin(), v_.end()); }
+
+    // Bilinear interpolation between nodes
+    double at(const point& pt) const
+    {
+        double fx = (pt.x - origin_.x) / h_, fy = (pt.y - origin_.y) / h_;
+        if (fx < 0 || fy < 0 || fx >= nx_ - 1 || fy >= ny_ - 1)
+            return -1;
+        size_t i = size_t(fx), j = size_t(fy);
+        fx -= i;
+        fy -= j;
+        return (*this)(i, j) * (1-fx) * (1-fy) + (*this)(i+1, j) * fx * (1-fy)
+            + (*this)(i, j+1) * (1-fx) * fy + (*this)(i+1, j+1) * fx * fy;
+    }
+
+private:
+    struct segment { point a, b; };
+
+    std::vector<segment> segments_;
+    point origin_;
+    double h_;
+    size_t nx_, ny_;
+    std::vector<double> v_;
+    std::vector<size_t> nearest_;
+
+    void try_segment(size_t i, size_t j, size_t s)
+    {
+        size_t k = j*nx_ + i;
+        double d = distance_xy(node(i, j), segments_[s].a, segments_[s].b);
+        if (d < v_[k]) {
+            v_[k] = d;
+            nearest_[k] = s;
+        }
+    }
+
+    // Walks along each segment, measuring the distance at nodes around it
+    void seed()
+    {
+        for (size_t s = 0; s != segments_.size(); ++s) {
+            vector ab = segments_[s].b - segments_[s].a;
+            size_t steps = size_t(ab.project_xy().length() / (h_ / 2)) + 1;
+            for (size_t t = 0; t <= steps; ++t) {
+                point p = segments_[s].a + ab * (double(t) / steps);
+                long ci = long(floor((p.x - origin_.x) / h_)), cj = long(floor((p.y - origin_.y) / h_));
+                for (long j = cj - 1; j <= cj + 2; ++j)
+                    for (long i = ci - 1; i <= ci + 2; ++i)
+                        if (i >= 0 && j >= 0 && i < long(nx_) && j < long(ny_))
+                            try_segment(i, j, s);
+            }
+        }
+    }
+
+    void propagate(size_t i, size_t j, std::initializer_list<std::pair<int, int>> neighbors)
+    {
+        for (const auto& n: neighbors) {
+            long ni = long(i) + n.first, nj = long(j) + n.second;
+            if (ni < 0 || nj < 0 || ni >= long(nx_) || nj >= long(ny_))
+                continue;
+            size_t s = nearest_[nj*nx_ + ni];
+            if (s != NONE && s != nearest_[j*nx_ + i])
+                try_segment(i, j, s);
+        }
+    }
+
+    // Parts of the horizontal line at `y` lying inside the boundary
+    std::vector<std::pair<double, double>> inside_spans(double y) const
+    {
+        std::vector<double> xs;
+        for (const segment& s: segments_) {
+            if ((s.a.y <= y) != (s.b.y <= y))
+                xs.push_back(s.a.x + (y - s.a.y) * (s.b.x - s.a.x) / (s.b.y - s.a.y));
+        }
+        std::sort(xs.begin(), xs.end());
+
+        std::vector<std::pair<double, double>> ret;
+        for (size_t i = 0; i + 1 < xs.size(); i += 2)
+            ret.push_back({ xs[i], xs[i+1] });
+        return ret;
+    }
+};
+
+// Closed iso-lines of `field` at `level`, with higher values on their left
+std::vector<polyline> contours(const distance_field& field, double level)
+{
+    enum { BOTTOM, RIGHT, TOP, LEFT };
+    static const int PAIRS[16][2][2] = {
+        {{ -1, -1 }, { -1, -1 }}, {{ BOTTOM, LEFT }, { -1, -1 }}, {{ BOTTOM, RIGHT }, { -1, -1 }}, {{ LEFT, RIGHT }, { -1, -1 }},
+        {{ RIGHT, TOP }, { -1, -1 }}, {{ -1, -1 }, { -1, -1 }}, {{ BOTTOM, TOP }, { -1, -1 }}, {{ LEFT, TOP }, { -1, -1 }},
+        {{ LEFT, TOP }, { -1, -1 }}, {{ BOTTOM, TOP }, { -1, -1 }}, {{ -1, -1 }, { -1, -1 }}, {{ RIGHT, TOP }, { -1, -1 }},
+        {{ LEFT, RIGHT }, { -1, -1 }}, {{ BOTTOM, RIGHT }, { -1, -1 }}, {{ BOTTOM, LEFT }, { -1, -1 }}, {{ -1, -1 }, { -1, -1 }}
+    };
+
+    size_t nx = field.nx();
+    std::unordered_map<size_t, size_t> next;
+    std::unordered_map<size_t, point> at;
+
+    // Edges are numbered 2*node for the one going right and 2*node + 1 for the one going up
+    auto edge_id = [nx](size_t i, size_t j, int edge) -> size_t {
+        switch (edge) {
+            case BOTTOM: return 2*(j*nx + i);
+            case RIGHT: return 2*(j*nx + i + 1) + 1;
+            case TOP: return 2*((j+1)*nx + i);
+            default: return 2*(j*nx + i) + 1;
+        }
+    };
+
+    auto crossing = [&](size_t i, size_t j, int edge) {
+        size_t i1 = i, j1 = j, i2 = i, j2 = j;
+        switch (edge) {
+            case BOTTOM: i2 = i + 1; break;
+            case RIGHT: i1 = i2 = i + 1; j2 = j + 1; break;
+            case TOP: j1 = j2 = j + 1; i2 = i + 1; break;
+            default: j2 = j + 1; break;
+        }
+        double v1 = field(i1, j1), v2 = field(i2, j2);
+        point p1 = field.node(i1, j1), p2 = field.node(i2, j2);
+        return p1 + (p2 - p1) * ((level - v1) / (v2 - v1));
+    };
+
+    for (size_t j = 0; j + 1 < field.ny(); ++j) {
+        for (size_t i = 0; i + 1 < nx; ++i) {
+            double v[4] = { field(i, j), field(i+1, j), field(i+1, j+1), field(i, j+1) };
+            int idx = (v[0] >= level) | (v[1] >= level) << 1 | (v[2] >= level) << 2 | (v[3] >= level) << 3;
+
+            int pairs[2][2];
+            std::copy(&PAIRS[idx][0][0], &PAIRS[idx][0][0] + 4, &pairs[0][0]);
+            if (idx == 5 || idx == 10) {
+                // Saddle: decide by the value in the middle of the cell
+                bool center_high = (v[0] + v[1] + v[2] + v[3]) / 4 >= level;
+                bool cut_low_corners = (idx == 5) == center_high;
+                int a[2][2] = {{ BOTTOM, RIGHT }, { LEFT, TOP }};
+                int b[2][2] = {{ BOTTOM, LEFT }, { RIGHT, TOP }};
+                std::copy(&(cut_low_corners ? a : b)[0][0], &(cut_low_corners ? a : b)[0][0] + 4, &pairs[0][0]);
+            }
+
+            for (const auto& pr: pairs) {
+                if (pr[0] < 0)
+                    continue;
+                point p = crossing(i, j, pr[0]), q = crossing(i, j, pr[1]);
+
+                // Orient the segment so that high corners stay on its left.
+                // Going around the cell counterclockwise, the corner right
+                // after the edge it ends on is on its left. This is decided
+                // by the table alone: crossings may land exactly on a node
+                // when it is at the level, leaving nothing to measure against
+                size_t from = edge_id(i, j, pr[0]), to = edge_id(i, j, pr[1]);
+                if (v[(pr[1] + 1) % 4] < level) {
+                    std::swap(from, to);
+                    std::swap(p, q);
+                }
+                next[from] = to;
+                at[from] = p;
+                at[to] = q;
+            }
+        }
+    }
+
+    std::vector<polyline> ret;
+    while (!next.empty()) {
+        size_t start = next.begin()->first, e = start;
+        polyline loop;
+        while (next.count(e)) {
+            loop.push_back(at[e]);
+            size_t n = next[e];
+            next.erase(e);
+            e = n;
+        }
+        if (loop.size() >= 3)
+            ret.push_back(std::move(loop));
+    }
+    return ret;
+}
+
+void simplify(const polyline& pts, size_t first, size_t last, polyline& out)
+{
+    double worst = 0;
+    size_t idx = first;
+    for (size_t i = first + 1; i < last; ++i) {
+        double d = distance_xy(pts[i], pts[first], pts[last]);
+        if (d > worst) {
+            worst = d;
+            idx = i;
+        }
+    }
+    if (worst > SIMPLIFY_TOLERANCE) {
+        simplify(pts, first, idx, out);
+        simplify(pts, idx, last, out);
+    } else {
+        out.push_back(pts[last]);
+    }
+}
+
+// Douglas-Peucker on a closed loop, starting and ending at its first point
+polyline simplify_loop(const polyline& loop)
+{
+    polyline pts(loop);
+    pts.push_back(loop.front());
+    size_t far = 0;
+    for (size_t i = 0; i != loop.size(); ++i)
+        if ((loop[i] - loop[0]).length() > (loop[far] - loop[0]).length())
+            far = i;
+
+    polyline ret = { pts.front() };
+    simplify(pts, 0, far, ret);
+    simplify(pts, far, pts.size() - 1, ret);
+    return ret;
+}
+
+} // namespace
+
+
+std::vector<path> pocket(const std::vector<polyline>& boundary, double tool_width, double stepover)
+{
+    if (tool_width <= 0)
+        throw std::runtime_error("bad tool width");
+    stepover = std::min(stepover, tool_width / 2);
+    if (stepover <= 0)
+        throw std::runtime_error("bad stepover");
+
+    distance_field field(boundary, tool_width / 12);
+    double r = tool_width / 2;
+
+    // Offset contours, innermost first
+    std::vector<std::vector<polyline>> levels;
+    for (double d = r; d < field.max(); d += stepover)
+        levels.push_back(contours(field, d));
+    std::reverse(levels.begin(), levels.end());
+
+    std::vector<path> ret;
+    point pos;
+    for (auto& level: levels) {
+        while (!level.empty()) {
+            // Nearest loop and the nearest point on it
+            size_t best_loop = 0, best_pt = 0;
+            double best = std::numeric_limits<double>::infinity();
+            for (size_t l = 0; l != level.size(); ++l) {
+                for (size_t i = 0; i != level[l].size(); ++i) {
+                    double dist = pos.defined() ? (level[l][i] - pos).project_xy().length() : 0;
+                    if (dist < best) {
+                        best = dist;
+                        best_loop = l;
+                        best_pt = i;
+                    }
+                }
+            }
+
+            polyline loop = level[best_loop];
+            level.erase(level.begin() + best_loop);
+            std::rotate(loop.begin(), loop.begin() + best_pt, loop.end());
+            loop = simplify_loop(loop);
+
+            // Go straight to the next loop unless that leaves the pocket
+            bool linked = false;
+            if (!ret.empty()) {
+                vector v = loop.front() - pos;
+                size_t steps = size_t(ceil(v.length() / (field.step() / 2))) + 1;
+                linked = true;
+                for (size_t s = 0; s <= steps && linked; ++s)
+                    linked = field.at(pos + v * (double(s) / steps)) >= r - EPSILON;
+            }
+
+            if (linked)
+                ret.back().line_to(loop.front());
+            else
+                ret.push_back(path(loop.front()));
+            for (auto i = loop.begin() + 1; i != loop.end(); ++i)
+                ret.back().line_to(*i);
+            pos = loop.back();
+        }
+    }
+    return ret;
+}
+
+} // namespace shapes
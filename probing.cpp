@@ -0,0 +1,110 @@
+#include "probing.h"
+#include "shapes.h"
+#include <algorithm>
+
+std::vector<point> trace_cuts(const gcode& gc, double step)
+{
+    std::vector<point> ret;
+    for (const polyline& cut: shapes::outline(gc)) {
+        for (size_t i = 0; i + 1 < cut.size(); ++i) {
+            vector d = cut[i+1] - cut[i];
+            size_t n = size_t(ceil(d.length() / step));
+            for (size_t k = 0; k != n; ++k)
+                ret.push_back(cut[i] + d * (double(k) / n));
+        }
+        ret.push_back(cut.back());
+    }
+    return ret;
+}
+
+point move_inside(const polyline& poly, const point& pt, double margin)
+{
+    bool inside = false;
+    point nearest;
+    double dist = INFINITY;
+    for (size_t i = 0; i + 1 < poly.size(); ++i) {
+        const point& a = poly[i];
+        const point& b = poly[i+1];
+        if ((a.y > pt.y) != (b.y > pt.y) && pt.x < a.x + (b.x - a.x) * (pt.y - a.y) / (b.y - a.y))
+            inside = !inside;
+
+        vector ab = (b - a).project_xy();
+        double t = ab.length() > 0 ? std::min(std::max(((pt - a).project_xy() * ab) / (ab * ab), 0.0), 1.0) : 0;
+        point q = a + ab * t;
+        double d = (pt - q).project_xy().length();
+        if (d < dist) {
+            dist = d;
+            nearest = q;
+        }
+    }
+    if (inside && dist >= margin)
+        return pt;
+
+    vector inward = (inside ? pt - nearest : nearest - pt).project_xy();
+    if (inward.length() < 1e-9)
+        return pt;
+    return point(nearest.x, nearest.y, pt.z) + inward.unit() * margin;
+}
+
+double surface_top(const std::vector<point>& measured, const point& from, const point& to, double reach)
+{
+    double top = NAN;
+    bool near_target = false;
+    vector d = (to - from).project_xy();
+    for (const point& m: measured) {
+        vector v = (m - from).project_xy();
+        double t = d.length() > 0 ? std::min(std::max((v * d) / (d * d), 0.0), 1.0) : 0;
+        if ((v - d * t).length() > reach)
+            continue;
+        top = std::isnan(top) ? m.z : std::max(top, m.z);
+        near_target = near_target || (m - to).project_xy().length() <= reach;
+    }
+    return near_target ? top : NAN;
+}
+
+double predict_surface(const std::vector<point>& measured, const point& pt, double reach, double& rms)
+{
+    // Normal equations for z = a + b*dx + c*dy around `pt`
+    double s[3][3] = {}, r[3] = {};
+    std::vector<point> near;
+    for (const point& m: measured) {
+        vector d = (m - pt).project_xy();
+        if (d.length() > reach)
+            continue;
+        near.push_back(m);
+        double v[3] = { 1, d.x, d.y };
+        for (size_t i = 0; i != 3; ++i) {
+            for (size_t j = 0; j != 3; ++j)
+                s[i][j] += v[i] * v[j];
+            r[i] += v[i] * m.z;
+        }
+    }
+    if (near.size() < 4)
+        return NAN;
+
+    auto det = [](const double (&m)[3][3]) {
+        return m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1])
+             - m[0][1] * (m[1][0]*m[2][2] - m[1][2]*m[2][0])
+             + m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    };
+    double d = det(s);
+    if (d < 1e-3 * s[0][0] * s[1][1] * s[2][2])
+        return NAN; // all in a line
+
+    double coef[3];
+    for (size_t k = 0; k != 3; ++k) {
+        double sk[3][3];
+        for (size_t i = 0; i != 3; ++i)
+            for (size_t j = 0; j != 3; ++j)
+                sk[i][j] = (j == k) ? r[i] : s[i][j];
+        coef[k] = det(sk) / d;
+    }
+
+    double sq = 0;
+    for (const point& m: near) {
+        vector dv = (m - pt).project_xy();
+        sq += pow(m.z - (coef[0] + coef[1] * dv.x + coef[2] * dv.y), 2);
+    }
+    rms = sqrt(sq / (near.size() - 3));
+    return coef[0];
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "geom.h"
+#include "gcode.h"
+#include <vector>
+
+// Points no more than `step` apart along the cuts of `gc`
+std::vector<point> trace_cuts(const gcode& gc, double step);
+
+// Moves `pt` to at least `margin` inside the loop `poly` unless it already is
+point move_inside(const polyline& poly, const point& pt, double margin);
+
+// Highest measured surface within `reach` of a straight move from `from`
+// to `to`; NaN unless some of the measurements are near `to`
+double surface_top(const std::vector<point>& measured, const point& from, const point& to, double reach);
+
+// Surface height at `pt` extrapolated by a least squares plane through the
+// measurements within `reach`, or NaN if there are too few to tell how well
+// it fits. `rms` receives the residual of the fit over the degrees of
+// freedom left by its three parameters, so that a handful of points
+// cannot pass for a close fit.
+double predict_surface(const std::vector<point>& measured, const point& pt, double reach, double& rms);
@@ -0,0 +1,218 @@
+#include "route.h"
+#include <algorithm>
+#include <limits>
+
+namespace {
+
+static const double EPSILON = 1e-6;
+
+// Improvement moves only look this far along the route, which keeps
+// passes near-linear on jobs with thousands of items.
+static const size_t MAX_SPAN = 1000;
+static const size_t MAX_PASSES = 20;
+static const size_t MAX_OR_OPT_SEGMENT = 3;
+
+// Unknown positions (e.g. before the first move of a job) cost nothing
+double distance(const point& a, const point& b)
+{
+    double d = (b - a).project_xy().length();
+    return std::isnan(d) ? 0 : d;
+}
+
+class route {
+public:
+    route(const std::vector<route_item>& items, const point& start, std::vector<route_step> steps):
+        items_(&items), start_(start), steps_(std::move(steps))
+    {}
+
+    size_t size() const { return steps_.size(); }
+    const std::vector<route_step>& steps() const { return steps_; }
+
+    const point& entry(size_t pos) const
+    {
+        const route_item& item = (*items_)[steps_[pos].index];
+        return steps_[pos].reversed ? item.exit : item.entry;
+    }
+
+    const point& exit(size_t pos) const
+    {
+        const route_item& item = (*items_)[steps_[pos].index];
+        return steps_[pos].reversed ? item.entry : item.exit;
+    }
+
+    const point& exit_before(size_t pos) const { return pos ? exit(pos - 1) : start_; }
+
+    bool reversible(size_t pos) const { return (*items_)[steps_[pos].index].reversible; }
+
+    bool two_opt()
+    {
+        bool improved = false;
+        for (size_t i = 0; i != size(); ++i) {
+            for (size_t j = i; j != size() && j - i < MAX_SPAN; ++j) {
+                if (!reversible(j))
+                    break;
+
+                double before = distance(exit_before(i), entry(i));
+                double after = distance(exit_before(i), exit(j));
+                if (j + 1 != size()) {
+                    before += distance(exit(j), entry(j + 1));
+                    after += distance(entry(i), entry(j + 1));
+                }
+
+                if (after < before - EPSILON) {
+                    std::reverse(steps_.begin() + i, steps_.begin() + j + 1);
+                    for (size_t k = i; k != j + 1; ++k)
+                        steps_[k].reversed = !steps_[k].reversed;
+                    improved = true;
+                }
+            }
+        }
+        return improved;
+    }
+
+    bool or_opt()
+    {
+        bool improved = false;
+        for (size_t len = 1; len <= MAX_OR_OPT_SEGMENT; ++len) {
+            for (size_t i = 0; i + len <= size(); ++i) {
+                if (try_move(i, len))
+                    improved = true;
+            }
+        }
+        return improved;
+    }
+
+private:
+    const std::vector<route_item>* items_;
+    point start_;
+    std::vector<route_step> steps_;
+
+    // Tries to move steps [i, i+len) elsewhere, possibly reversing them.
+    bool try_move(size_t i, size_t len)
+    {
+        size_t last = i + len - 1;
+        bool can_flip = true;
+        for (size_t k = i; k != i + len; ++k)
+            can_flip = can_flip && reversible(k);
+
+        double gain = distance(exit_before(i), entry(i));
+        if (last + 1 != size())
+            gain += distance(exit(last), entry(last + 1)) - distance(exit_before(i), entry(last + 1));
+
+        size_t lo = (i > MAX_SPAN) ? i - MAX_SPAN : 0;
+        size_t hi = std::min(size(), last + 1 + MAX_SPAN);
+
+        double best = gain - EPSILON;
+        size_t best_pos = size() + 1;
+        bool best_flip = false;
+
+        for (size_t q = lo; q <= hi; ++q) {
+            if (q >= i && q <= last + 1)
+                continue;
+
+            const point& a = (q < i) ? exit_before(q) : exit(q - 1);
+            const point* b = (q < size()) ? &entry(q) : nullptr;
+
+            for (bool flip: { false, true }) {
+                if (flip && !can_flip)
+                    continue;
+                const point& seg_entry = flip ? exit(last) : entry(i);
+                const point& seg_exit = flip ? entry(i) : exit(last);
+
+                double cost = distance(a, seg_entry);
+                if (b)
+                    cost += distance(seg_exit, *b) - distance(a, *b);
+
+                if (cost < best) {
+                    best = cost;
+                    best_pos = q;
+                    best_flip = flip;
+                }
+            }
+        }
+
+        if (best_pos > size())
+            return false;
+
+        std::vector<route_step> seg(steps_.begin() + i, steps_.begin() + i + len);
+        if (best_flip) {
+            std::reverse(seg.begin(), seg.end());
+            for (route_step& s: seg)
+                s.reversed = !s.reversed;
+        }
+        steps_.erase(steps_.begin() + i, steps_.begin() + i + len);
+        if (best_pos > i)
+            best_pos -= len;
+        steps_.insert(steps_.begin() + best_pos, seg.begin(), seg.end());
+        return true;
+    }
+};
+
+std::vector<route_step> nearest_neighbor(const std::vector<route_item>& items, const point& start)
+{
+    std::vector<route_step> ret;
+    std::vector<bool> used(items.size(), false);
+    point cur = start;
+
+    while (ret.size() != items.size()) {
+        double best = std::numeric_limits<double>::infinity();
+        route_step step = { 0, false };
+
+        for (size_t i = 0; i != items.size(); ++i) {
+            if (used[i])
+                continue;
+            double d = distance(cur, items[i].entry);
+            if (d < best) {
+                best = d;
+                step = { i, false };
+            }
+            if (items[i].reversible && (d = distance(cur, items[i].exit)) < best) {
+                best = d;
+                step = { i, true };
+            }
+        }
+
+        used[step.index] = true;
+        ret.push_back(step);
+        cur = step.reversed ? items[step.index].entry : items[step.index].exit;
+    }
+
+    return ret;
+}
+
+} // namespace
+
+
+std::vector<route_step> identity_route(size_t count)
+{
+    std::vector<route_step> ret;
+    for (size_t i = 0; i != count; ++i)
+        ret.push_back({ i, false });
+    return ret;
+}
+
+std::vector<route_step> plan_route(const std::vector<route_item>& items, const point& start)
+{
+    route r(items, start, nearest_neighbor(items, start));
+    for (size_t pass = 0; pass != MAX_PASSES; ++pass) {
+        bool improved = r.two_opt();
+        improved = r.or_opt() || improved;
+        if (!improved)
+            break;
+    }
+
+    // Never make things worse than what we were given
+    auto ret = r.steps();
+    if (route_length(items, ret, start) > route_length(items, identity_route(items.size()), start))
+        ret = identity_route(items.size());
+    return ret;
+}
+
+double route_length(const std::vector<route_item>& items, const std::vector<route_step>& steps, const point& start)
+{
+    route r(items, start, steps);
+    double ret = 0;
+    for (size_t i = 0; i != r.size(); ++i)
+        ret += distance(r.exit_before(i), r.entry(i));
+    return ret;
+}
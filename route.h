@@ -0,0 +1,27 @@
+#pragma once
+
+#include "geom.h"
+#include <vector>
+
+// Something to be visited on a route: we arrive at `entry` and leave from `exit`.
+// Reversible items may be traversed from `exit` to `entry` instead.
+struct route_item {
+    point entry;
+    point exit;
+    bool reversible;
+};
+
+struct route_step {
+    size_t index;
+    bool reversed;
+};
+
+// Orders items to minimize XY travel starting from `start`,
+// using nearest neighbor followed by 2-opt and Or-opt passes.
+std::vector<route_step> plan_route(const std::vector<route_item>& items, const point& start);
+
+// Route visiting items in their original order.
+std::vector<route_step> identity_route(size_t count);
+
+// XY travel between items (not including travel inside them).
+double route_length(const std::vector<route_item>& items, const std::vector<route_step>& route, const point& start);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+
 namespace settings {
 // TODO: configure those
 
@@ -26,6 +28,25 @@ static const settings MILL = {
 
 struct global_params {
     bool dump_wire = false;
+    bool cleanup_gcode = true;
+    double arc_tolerance = 0.01; // mm; zero to disable arc fitting
+    bool optimize_travel = true;
+    double link_distance = 0.2; // mm; longer hops are linked only over already cut paths; negative to never link
+    bool rapid_air_moves = true;
+    double air_clearance = 0.5; // mm above the surface
+    double hmap_cell_size = 10; // mm; bicubic interpolation gets along with coarser grids
+    double hmap_tolerance = 0; // mm; zero to scan a uniform grid
+    double hmap_plane_tolerance = 0; // mm; fit a plane first and scan a grid only if it is off by more; zero to always scan
+    size_t hmap_max_probes = 200;
+    double hmap_max_time = 1800; // s
+    bool hmap_sparse = false; // probe only cells with cuts in them
+    double hmap_verify_tolerance = 0.02; // mm a stored point may drift by beyond offset and tilt before its area gets re-probed
+    bool hmap_lazy = false; // 'run hmap+mill' probes each cell right before milling enters it
+    double probe_clearance = 0.3; // mm above the surface measured nearby
+    double probe_seek_feed = 100; // mm/min; zero to touch slowly all the way
+    double probe_backoff = 0.2; // mm between the fast seek and the slow touch
+    double probe_margin = 0.05; // mm above the predicted surface to touch from
+    bool stream_probes = false; // send the whole grid scan to Grbl at once
 };
 
 extern global_params g_params;
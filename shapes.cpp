@@ -13,132 +13,270 @@ depth_list::depth_list(double d1, double d2, double step)
     depths_.push_back(d2);
 }
 
-polyline depth_list::operator()(polyline p) const
+shapes::path depth_list::operator()(shapes::path p) const
 {
-    polyline ret;
+    shapes::path ret;
+    for (double depth: depths_) {
+        ret.append(p.shifted(vector::axis::z(-depth)));
+        p = p.reversed();
+    }
+    return ret;
+}
 
+shapes::path depth_list::ramp(shapes::path p) const
+{
+    if (!p.closed() || depths_.empty())
+        return (*this)(p);
+
+    shapes::path ret;
+    double z = 0;
     for (double depth: depths_) {
-        std::transform(
-            p.begin(), p.end(), std::back_inserter(ret),
-            [d = vector::axis::z(-depth)](point pt) { return pt + d; }
-        );
-        std::reverse(p.begin(), p.end());
+        ret.append(p.ramped(z, -depth));
+        z = -depth;
     }
+    ret.append(p.shifted(vector::axis::z(z - p.start().z)));
     return ret;
 }
 
 namespace shapes {
 
-namespace impl {
+namespace {
 
-template<class OutIter>
-OutIter arc(point center, double radius, double start_angle, double arc_angle, OutIter out)
+// Signed angle swept by `s` starting at `from`, in (-2pi; 2pi)
+double sweep(const point& from, const path::segment& s)
 {
-    static const double PRECISION = 0.05 /*mm*/;
-    double step = PRECISION / radius;
-    double direction = arc_angle / fabs(arc_angle);
-    for (double a = 0; fabs(a) < fabs(arc_angle); a += step * direction)
-        *out++ = center + vector::axis::x(radius).rotate(start_angle + a);
-    return out;
+    double ret = (from - s.center).project_xy().angle_to((s.end - s.center).project_xy());
+    if (s.ccw && ret <= 0)
+        ret += 2*M_PI;
+    else if (!s.ccw && ret >= 0)
+        ret -= 2*M_PI;
+    return ret;
 }
 
-template<class OutIter>
-OutIter circle(double radius, OutIter out)
+double length_xy(const point& from, const path::segment& s)
 {
-    *out++ = point::from_vector(vector::axis::x(radius));
-    out = arc(point(0,0,0), radius, 0, 2*M_PI, out);
-    *out++ = point::from_vector(vector::axis::x(radius));
-    return out;
-}   
+    if (s.is_arc())
+        return fabs(sweep(from, s)) * (from - s.center).project_xy().length();
+    else
+        return (s.end - from).project_xy().length();
+}
 
-} // namespace impl
+} // namespace
 
-polyline circle(double radius)
+path::path(const polyline& pts)
 {
-    polyline ret;
-    impl::circle(radius, std::back_inserter(ret));
+    if (pts.empty())
+        return;
+    start_ = pts.front();
+    for (auto i = pts.begin() + 1; i != pts.end(); ++i)
+        line_to(*i);
+}
+
+path& path::line_to(const point& pt)
+{
+    segments_.push_back({ pt, point(), false });
+    return *this;
+}
+
+path& path::arc_to(const point& pt, const point& center, bool ccw)
+{
+    segments_.push_back({ pt, center, ccw });
+    return *this;
+}
+
+path& path::arc_by(const point& center, double angle)
+{
+    // Keep arcs no longer than a half circle, so that their
+    // end points never coincide and I/J stay unambiguous
+    if (fabs(angle) > M_PI + 1e-9) {
+        arc_by(center, angle / 2);
+        return arc_by(center, angle / 2);
+    }
+    point c(center.x, center.y, end().z);
+    return arc_to(c + (end() - c).rotate(angle), c, angle > 0);
+}
+
+path& path::append(const path& p)
+{
+    if (p.empty())
+        return *this;
+    if (empty()) {
+        start_ = p.start_;
+    } else if ((p.start_ - end()).length() > 1e-9) {
+        line_to(p.start_);
+    }
+    segments_.insert(segments_.end(), p.segments_.begin(), p.segments_.end());
+    return *this;
+}
+
+path path::reversed() const
+{
+    path ret(end());
+    for (size_t i = segments_.size(); i-- > 0;) {
+        const point& to = i ? segments_[i-1].end : start_;
+        ret.segments_.push_back({ to, segments_[i].center, !segments_[i].ccw });
+    }
     return ret;
 }
 
-polyline filled_circle(double r1, double r2, double width)
+path path::shifted(const vector& v) const
 {
-    double inner_radius = std::min(r1, r2);
-    double outer_radius = std::max(r1, r2);
-    if (width/2 > outer_radius - inner_radius)
-        throw std::runtime_error("tool width exceeds shape width");
-    
-    polyline ret;
-    for (double r = inner_radius + width/2; r < outer_radius - width*0.75; r += width/2)
-        impl::circle(r, std::back_inserter(ret));
+    path ret(start_ + v);
+    for (const segment& s: segments_)
+        ret.segments_.push_back({ s.end + v, s.is_arc() ? s.center + v : point(), s.ccw });
+    return ret;
+}
 
-    impl::circle(outer_radius - width/2, std::back_inserter(ret));    
-    
+double path::length() const
+{
+    double ret = 0;
+    point pos = start_;
+    for (const segment& s: segments_) {
+        ret += length_xy(pos, s);
+        pos = s.end;
+    }
     return ret;
 }
 
-polyline box(double width, double height)
+path path::ramped(double z0, double z1) const
 {
-    polyline ret;
-    ret.push_back(point(0,0,0));
-    ret.push_back(point(width, 0, 0));
-    ret.push_back(point(width, height, 0));
-    ret.push_back(point(0, height, 0));
-    ret.push_back(point(0,0,0));
+    double total = length();
+    path ret(point(start_.x, start_.y, z0));
+    point pos = start_;
+    double done = 0;
+    for (const segment& s: segments_) {
+        done += length_xy(pos, s);
+        double z = total > 0 ? z0 + (z1 - z0) * done / total : z1;
+        ret.segments_.push_back({
+            point(s.end.x, s.end.y, z),
+            s.is_arc() ? point(s.center.x, s.center.y, z) : point(),
+            s.ccw
+        });
+        pos = s.end;
+    }
     return ret;
 }
 
-polyline box(double width, double height, double radius)
+polyline path::flatten(double precision /* = 0.05 */) const
 {
     polyline ret;
+    if (empty())
+        return ret;
 
-    ret.push_back(point(0, radius, 0));
-    
-    ret.push_back(point(0, height-radius, 0));
-    impl::arc(point(radius, height-radius, 0), radius, M_PI, -M_PI/2, std::back_inserter(ret));
-    
-    ret.push_back(point(width-radius, height, 0));
-    impl::arc(point(width-radius, height-radius, 0), radius, M_PI/2, -M_PI/2, std::back_inserter(ret));
-    
-    ret.push_back(point(width, radius, 0));
-    impl::arc(point(width-radius, radius, 0), radius, 0, -M_PI/2, std::back_inserter(ret));
-    
-    ret.push_back(point(radius, 0, 0));
-    impl::arc(point(radius, radius, 0), radius, -M_PI/2, -M_PI/2, std::back_inserter(ret));
-    
-    ret.push_back(point(0, radius, 0));
+    ret.push_back(start_);
+    for (const segment& s: segments_) {
+        if (s.is_arc()) {
+            point from = ret.back();
+            vector r = (from - s.center).project_xy();
+            double angle = sweep(from, s);
+
+            double step = precision / r.length();
+            for (double a = step; a < fabs(angle); a += step) {
+                double t = a / fabs(angle);
+                ret.push_back(s.center + r.rotate(angle * t) + vector::axis::z(from.z - s.center.z + (s.end.z - from.z) * t));
+            }
+        }
+        ret.push_back(s.end);
+    }
     return ret;
 }
 
-polyline filled_box(double width, double height, double tool_width)
+std::vector<gcmd> path::commands() const
 {
-    polyline ret;
-    double tw2 = tool_width/2;
-    vector yleg = vector::axis::y(height - 4*tw2);
-    point pt(2*tw2, 2*tw2, 0);
-    double dir = 1;
-    ret.push_back(pt);
-    
-    bool first = true;
-    for (double x = 2*tw2; x < width - 2*tw2; x += tw2/2) {
-        if (first) {
-            first = false;
+    std::vector<gcmd> ret;
+    if (empty())
+        return ret;
+
+    ret.push_back(gcmd("G1", start_));
+    point pos = start_;
+    for (const segment& s: segments_) {
+        if (s.is_arc()) {
+            vector d = (s.center - pos).project_xy();
+            ret.push_back(gcmd(s.ccw ? "G3" : "G2", s.end, { d.x, d.y, NAN }));
         } else {
-            impl::arc(pt + vector::axis::x(tw2/4), tw2/4, -M_PI, M_PI * dir, std::back_inserter(ret));
-            pt += vector::axis::x(tw2/2);
+            ret.push_back(gcmd("G1", s.end));
         }
-
-        pt += yleg * dir;
-        ret.push_back(pt);
-        dir *= -1;
+        pos = s.end;
     }
+    return ret;
+}
+
+
+path circle(double radius)
+{
+    return path(point::from_vector(vector::axis::x(radius))).arc_by(point::zero(), 2*M_PI);
+}
+
+std::vector<path> filled_circle(double r1, double r2, double tool_width, double stepover)
+{
+    double inner_radius = std::min(r1, r2);
+    double outer_radius = std::max(r1, r2);
+    if (tool_width/2 > outer_radius - inner_radius)
+        throw std::runtime_error("tool width exceeds shape width");
     
-    ret.push_back(point(width - tw2, tw2, 0));
-    ret.push_back(point(width - tw2, height - tw2, 0));
-    ret.push_back(point(tw2, height - tw2, 0));
-    ret.push_back(point(tw2, tw2, 0));
-    ret.push_back(point(width - tw2, tw2, 0));
+    std::vector<polyline> boundary = { circle(outer_radius).flatten() };
+    if (inner_radius > 0)
+        boundary.push_back(circle(inner_radius).flatten());
+    return pocket(boundary, tool_width, stepover);
+}
 
+std::vector<polyline> outline(const gcode& gc)
+{
+    std::vector<polyline> ret;
+    for (const gcode::chain& ch: gc.chains()) {
+        path p;
+        point pos;
+        for (size_t i = ch.begin; i != ch.end; ++i) {
+            const gcmd& c = gc[i];
+            if (c.letter() != 'G' || c.arg() > 3 || !c.point().defined())
+                continue;
+            if (c.point().z <= 0) {
+                if (p.empty())
+                    p = path(pos.defined() && pos.z <= 0 ? pos : c.point());
+                if (c.arg() >= 2)
+                    p.arc_to(c.point(), pos + vector(c.delta().x, c.delta().y, 0), c.arg() == 3);
+                else
+                    p.line_to(c.point());
+            }
+            pos = c.point();
+        }
+        if (!p.empty()) {
+            polyline loop = p.flatten();
+            for (point& pt: loop)
+                pt.z = 0;
+            ret.push_back(std::move(loop));
+        }
+    }
     return ret;
 }
 
+path box(double width, double height)
+{
+    return path(point(0,0,0))
+        .line_to(point(width, 0, 0))
+        .line_to(point(width, height, 0))
+        .line_to(point(0, height, 0))
+        .line_to(point(0,0,0));
+}
+
+path box(double width, double height, double radius)
+{
+    return path(point(0, radius, 0))
+        .line_to(point(0, height-radius, 0))
+        .arc_by(point(radius, height-radius, 0), -M_PI/2)
+        .line_to(point(width-radius, height, 0))
+        .arc_by(point(width-radius, height-radius, 0), -M_PI/2)
+        .line_to(point(width, radius, 0))
+        .arc_by(point(width-radius, radius, 0), -M_PI/2)
+        .line_to(point(radius, 0, 0))
+        .arc_by(point(radius, radius, 0), -M_PI/2);
+}
+
+std::vector<path> filled_box(double width, double height, double tool_width, double stepover)
+{
+    if (tool_width > std::min(width, height))
+        throw std::runtime_error("tool width exceeds shape width");
+    return pocket({ box(width, height).flatten() }, tool_width, stepover);
+}
+
 } // namespace shapes
@@ -1,6 +1,69 @@
 #pragma once
 
 #include "geom.h"
+#include "gcode.h"
+
+namespace shapes {
+
+// A sequence of straight and circular segments starting at start()
+class path {
+public:
+    struct segment {
+        point end;
+        point center;    // undefined for straight segments
+        bool ccw;
+
+        bool is_arc() const { return center.defined(); }
+    };
+
+    path() {}
+    explicit path(const point& start): start_(start) {}
+    explicit path(const polyline& pts);
+
+    const point& start() const { return start_; }
+    const point& end() const { return segments_.empty() ? start_ : segments_.back().end; }
+    const std::vector<segment>& segments() const { return segments_; }
+    bool empty() const { return !start_.defined(); }
+    // Whether the path ends where it starts, disregarding Z
+    bool closed() const { return !empty() && (end() - start_).project_xy().length() < 1e-9; }
+    double length() const;
+
+    path& line_to(const point& pt);
+    path& arc_to(const point& pt, const point& center, bool ccw);
+    // Arc around `center` continuing from the current end by `angle` (counterclockwise if positive)
+    path& arc_by(const point& center, double angle);
+
+    // Appends `p`, joining it with a straight segment if needed
+    path& append(const path& p);
+
+    path reversed() const;
+    path shifted(const vector& v) const;
+    // Same path in XY, with Z changing linearly along its length from `z0` to `z1`
+    path ramped(double z0, double z1) const;
+
+    // Approximates arcs with chords no longer than `precision`
+    polyline flatten(double precision = 0.05 /*mm*/) const;
+
+    // G1 to the start, then G1 for straight segments and G2/G3 for arcs
+    std::vector<gcmd> commands() const;
+
+private:
+    point start_;
+    std::vector<segment> segments_;
+};
+
+// Whether arcs stay circular under `xf`, i.e. it does not scale
+// or skew, so they may be passed through as G2/G3
+template<class F>
+bool preserves_arcs(const F& xf)
+{
+    vector ex = xf(point(1, 0, 0)) - xf(point::zero()), ey = xf(point(0, 1, 0)) - xf(point::zero());
+    return fabs(ex.project_xy().length() - ey.project_xy().length()) < 1e-9
+        && fabs(ex.project_xy() * ey.project_xy()) < 1e-9;
+}
+
+} // namespace shapes
+
 
 class depth_list {
 public:
@@ -9,7 +72,12 @@ public:
     depth_list(double start_depth, double end_depth, double step);
 
     const std::vector<double>& depths() const { return depths_; }
-    polyline operator()(polyline p) const;
+    shapes::path operator()(shapes::path p) const;
+
+    // Closed paths descend continuously from the surface, one lap per
+    // depth step (helically on arcs), finishing with a flat lap at the
+    // last depth. Open paths are cut layer by layer as above.
+    shapes::path ramp(shapes::path p) const;
 
 private:
     std::vector<double> depths_;
@@ -17,13 +85,22 @@ private:
 
 namespace shapes {
 
-inline polyline segment(vector v) { return { {0,0,0}, point::from_vector(v) }; }
+inline path segment(vector v) { return path(point::zero()).line_to(point::from_vector(v)); }
+
+// Clears the area inside `boundary` (loops combined by the even-odd rule,
+// so inner loops are islands) with offset contours `stepover` apart,
+// innermost first. Contours are joined by straight moves where these stay
+// inside the area; each of the returned paths needs a plunge of its own.
+std::vector<path> pocket(const std::vector<polyline>& boundary, double tool_width, double stepover);
+
+// Cut paths of all chains in `gc`, to be used as a pocket boundary
+std::vector<polyline> outline(const gcode& gc);
 
-polyline circle(double radius);
-polyline filled_circle(double r1, double r2, double width);
+path circle(double radius);
+std::vector<path> filled_circle(double r1, double r2, double tool_width, double stepover);
 
-polyline box(double width, double height);
-polyline box(double width, double height, double radius);
-polyline filled_box(double width, double height, double tool_width);
+path box(double width, double height);
+path box(double width, double height, double radius);
+std::vector<path> filled_box(double width, double height, double tool_width, double stepover);
 
 } // namespace shapes
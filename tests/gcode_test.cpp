@@ -97,3 +97,418 @@ M5
     
     CHECK(i == ie);
 }
+
+TEST_CASE("gcode_chains", "[gcode][optimize]")
+{
+    std::istringstream gfile(R"(
+M3
+G0 X0 Y0 Z1
+G0 X30 Y0
+G1 Z-0.1 F100
+G1 X40 Y0
+G0 Z1
+G0 X1 Y0
+G1 Z-0.1
+G1 X10 Y0
+G0 Z1
+M5
+M3
+G0 X20 Y0
+G1 Z-0.1
+G1 X11 Y0
+G0 Z1
+M5
+)");
+    gcode g(gfile);
+    auto chains = g.chains();
+    
+    REQUIRE(chains.size() == 3);
+    CHECK(chains[0].begin == 2);
+    CHECK(chains[0].end == 6);
+    CHECK(chains[0].entry == approx(point(30, 0, 1)));
+    CHECK(chains[0].exit == approx(point(40, 0, 1)));
+    CHECK(!chains[0].reversible);
+    CHECK(chains[1].reversible);
+    CHECK(chains[1].feed_in == approx(100));
+    CHECK(chains[0].section == chains[1].section);
+    CHECK(chains[1].section != chains[2].section);
+}
+
+TEST_CASE("gcode_chains_drill", "[gcode][optimize]")
+{
+    std::istringstream gfile(R"(
+G90
+T1
+M5
+M6
+(MSG, Change to tool dia=0.4)
+M0
+M3
+G0 X2 Y2 Z1
+G1 Z-1.8 F75
+G1 Z0
+G0 Z1
+G0 X9 Y2
+G1 Z-1.8
+G1 Z0
+G0 Z1
+T2
+M5
+M6
+(MSG, Change to tool dia=0.8)
+M0
+M3
+G0 X6 Y2 Z1
+G1 Z-1.8
+G1 Z0
+G0 Z1
+M5
+)");
+    gcode g(gfile);
+    auto chains = g.chains();
+    
+    // One chain per hole, one section per tool
+    REQUIRE(chains.size() == 3);
+    CHECK(chains[0].begin == 7);
+    CHECK(chains[0].end == 11);
+    CHECK(chains[1].begin == 11);
+    CHECK(chains[1].end == 15);
+    CHECK(chains[2].begin == 21);
+    CHECK(chains[2].end == 25);
+    CHECK(chains[0].section == chains[1].section);
+    CHECK(chains[1].section != chains[2].section);
+    for (const auto& ch: chains)
+        for (size_t i = ch.begin; i != ch.end; ++i)
+            CHECK(g[i].letter() == 'G');
+}
+
+TEST_CASE("gcode_optimize_travel", "[gcode][optimize]")
+{
+    std::istringstream gfile(R"(
+M3
+G0 X0 Y0 Z1
+G0 X30 Y0
+G1 Z-0.1 F100
+G1 X40 Y0
+G0 Z1
+G0 X1 Y0
+G1 Z-0.1
+G1 X10 Y0
+G0 Z1
+G0 X20 Y0
+G1 Z-0.1
+G1 X11 Y0
+G0 Z1
+M5
+)");
+    gcode g(gfile);
+    auto stats = g.optimize_travel();
+    
+    CHECK(stats.before == approx(79));
+    CHECK(stats.after == approx(12));
+    
+    std::vector<std::string> expected = {
+        "M3",
+        "G0 X0.000 Y0.000 Z1.000",
+        "F100",
+        "G0 X1.000 Y0.000 Z1.000",
+        "G1 X1.000 Y0.000 Z-0.100",
+        "G1 X10.000 Y0.000 Z-0.100",
+        "G0 X10.000 Y0.000 Z1.000",
+        "G0 X11.000 Y0.000 Z1.000",
+        "G1 X11.000 Y0.000 Z-0.100",
+        "G1 X20.000 Y0.000 Z-0.100",
+        "G0 X20.000 Y0.000 Z1.000",
+        "G0 X30.000 Y0.000 Z1.000",
+        "G1 X30.000 Y0.000 Z-0.100 F100.000",
+        "G1 X40.000 Y0.000 Z-0.100",
+        "G0 X40.000 Y0.000 Z1.000",
+        "M5"
+    };
+    
+    std::vector<std::string> actual;
+    for (const gcmd& c: g)
+        actual.push_back(lexical_cast<std::string>(c));
+    CHECK(actual == expected);
+}
+
+TEST_CASE("gcode_optimize_travel_retracts", "[gcode][optimize]")
+{
+    // Retracting in two steps leaves no single move to plunge with backwards
+    std::istringstream gfile(R"(
+M3
+G0 X0 Y0 Z1
+G0 X40 Y0
+G1 Z-0.1
+G1 X1 Y0
+G0 Z1
+G0 Z2
+G0 X50 Y0
+G1 Z-0.1
+G1 X45 Y0
+G0 Z1
+M5
+)");
+    gcode g(gfile);
+    auto chains = g.chains();
+    REQUIRE(chains.size() == 2);
+    CHECK(!chains[0].reversible);
+    CHECK(chains[1].reversible);
+    
+    g.optimize_travel();
+    for (const gcmd& c: g)
+        if (c.equals('G', 0) && c.point().defined())
+            CHECK(c.point().z > 0);
+}
+
+TEST_CASE("gcode_rapid_air_moves", "[gcode][optimize]")
+{
+    std::istringstream gfile(R"(
+G0 X0 Y0 Z1
+G1 X2 Y0 Z1 F75
+G1 Z-1.8
+G1 Z0
+G0 Z1
+G0 X4 Y0
+G1 Z0.1
+G1 X6 Y0
+)");
+    gcode g(gfile);
+    
+    // Surface slopes up along X
+    size_t count = g.rapid_air_moves([](const point& pt) { return pt.x * 0.05; }, 0.5);
+    CHECK(count == 4);
+    
+    std::vector<std::string> expected = {
+        "G0 X0.000 Y0.000 Z1.000",
+        "G0 X2.000 Y0.000 Z1.000 F75.000",
+        "G0 X2.000 Y0.000 Z0.600",
+        "G1 X2.000 Y0.000 Z-1.800",
+        "G0 X2.000 Y0.000 Z0.000",
+        "G0 X2.000 Y0.000 Z1.000",
+        "G0 X4.000 Y0.000 Z1.000",
+        "G0 X4.000 Y0.000 Z0.700",
+        "G1 X4.000 Y0.000 Z0.100",
+        "G1 X6.000 Y0.000 Z0.100"
+    };
+    
+    std::vector<std::string> actual;
+    for (const gcmd& c: g)
+        actual.push_back(lexical_cast<std::string>(c));
+    CHECK(actual == expected);
+}
+
+TEST_CASE("gcode_link_chains", "[gcode][optimize]")
+{
+    std::istringstream gfile(R"(
+G0 X0 Y0 Z1
+G1 Z-0.1 F100
+G1 X10 Y0 F200
+G0 Z1
+G0 X10.1 Y0
+G1 Z-0.1 F100
+G1 X10.1 Y5 F200
+G0 Z1
+G0 X5 Y5
+G1 Z-0.1 F100
+G1 X0 Y5 F200
+G1 X0 Y10
+G0 Z1
+G0 X0 Y7
+G1 Z-0.1 F100
+G1 X10 Y7 F200
+G0 Z1
+G0 X10 Y10
+G1 Z-0.2 F100
+G1 X0 Y10 F200
+G0 Z1
+)");
+    gcode g(gfile);
+    gcode unlinked(g);
+    CHECK(unlinked.link_chains(-1) == 0);
+    CHECK(unlinked.size() == g.size());
+    CHECK(g.link_chains(0.2) == 2);
+    
+    std::vector<std::string> expected = {
+        "G0 X0.000 Y0.000 Z1.000",
+        "G1 X0.000 Y0.000 Z-0.100 F100.000",
+        "G1 X10.000 Y0.000 Z-0.100 F200.000",
+        // short hop
+        "G1 X10.100 Y0.000 Z-0.100",
+        "G1 X10.100 Y5.000 Z-0.100 F200.000",
+        // too far, nothing cut in between
+        "G0 X10.100 Y5.000 Z1.000",
+        "G0 X5.000 Y5.000 Z1.000",
+        "G1 X5.000 Y5.000 Z-0.100 F100.000",
+        "G1 X0.000 Y5.000 Z-0.100 F200.000",
+        "G1 X0.000 Y10.000 Z-0.100",
+        // back along the cut we have just made
+        "G1 X0.000 Y7.000 Z-0.100",
+        "G1 X10.000 Y7.000 Z-0.100 F200.000",
+        // different depth
+        "G0 X10.000 Y7.000 Z1.000",
+        "G0 X10.000 Y10.000 Z1.000",
+        "G1 X10.000 Y10.000 Z-0.200 F100.000",
+        "G1 X0.000 Y10.000 Z-0.200 F200.000",
+        "G0 X0.000 Y10.000 Z1.000"
+    };
+    
+    std::vector<std::string> actual;
+    for (const gcmd& c: g)
+        actual.push_back(lexical_cast<std::string>(c));
+    CHECK(actual == expected);
+}
+
+TEST_CASE("gcode_link_chains_partial", "[gcode][optimize]")
+{
+    std::istringstream gfile(R"(
+G0 X0 Y0 Z1
+G1 Z-0.1 F100
+G1 X10 Y0
+G1 X10 Y5
+G0 Z1
+G0 X10 Y1
+G1 Z-0.1
+G1 X20 Y1
+G0 Z1
+G0 X5 Y1
+G1 Z-0.1
+G1 X5 Y8
+G0 Z1
+)");
+    gcode g(gfile);
+    
+    // Back down the cut along X10 links; the last hop only
+    // runs along a cut for its first two thirds and does not
+    CHECK(g.link_chains(0.2) == 1);
+    size_t retracts = std::count_if(g.begin(), g.end(), [](const gcmd& c) { return c.equals('G', 0) && c.point().z > 0; });
+    CHECK(retracts == 4);
+}
+
+TEST_CASE("gcode_cleanup", "[gcode][optimize]")
+{
+    std::istringstream gfile(R"(
+G90
+G21
+F100
+S1000
+M3
+G0 X0 Y0 Z1
+G0 X0 Y0 Z1
+F100
+G1 Z-0.1
+G1 X10 Y0
+G1 X10 Y0
+G1 X10 Y5
+G0 Z1
+G0 X0 Y0
+G1 Z-0.1
+G1 X10 Y0
+G1 X20 Y0
+G1 X20 Y0 F200
+G1 X10 Y0
+G0 Z1
+G90
+S1000
+M5
+)");
+    gcode g(gfile);
+    auto stats = g.cleanup();
+    
+    CHECK(stats.modal == 3);
+    CHECK(stats.zero_length == 2);
+    CHECK(stats.duplicates == 2);
+    CHECK(stats.total() == 7);
+    
+    std::vector<std::string> expected = {
+        "G90",
+        "G21",
+        "F100",
+        "S1000",
+        "M3",
+        "G0 X0.000 Y0.000 Z1.000",
+        "G1 X0.000 Y0.000 Z-0.100",
+        "G1 X10.000 Y0.000 Z-0.100",
+        "G1 X10.000 Y5.000 Z-0.100",
+        "G0 X10.000 Y5.000 Z1.000",
+        // first cut repeats an earlier one: plunge where it ends instead
+        "G0 X10.000 Y0.000 Z1.000",
+        "G1 X10.000 Y0.000 Z-0.100",
+        "G1 X20.000 Y0.000 Z-0.100",
+        "G1 X20.000 Y0.000 Z-0.100 F200.000",
+        // last cut goes back over the previous one: retract right away
+        "G0 X20.000 Y0.000 Z1.000",
+        "M5"
+    };
+    
+    std::vector<std::string> actual;
+    for (const gcmd& c: g)
+        actual.push_back(lexical_cast<std::string>(c));
+    CHECK(actual == expected);
+}
+
+TEST_CASE("gcode_fit_arcs", "[gcode][arcs]")
+{
+    std::ostringstream text;
+    text << "G0 X15 Y10 Z1\nG1 Z-0.1 F100\n";
+    // Most of a circle around (10, 10) as short segments...
+    for (int i = 1; i <= 90; ++i)
+        text << "G1 X" << 10 + 5*cos(deg(i*3)) << " Y" << 10 + 5*sin(deg(i*3)) << "\n";
+    // ...followed by a straight line
+    for (int i = 1; i <= 10; ++i)
+        text << "G1 X" << 5 - i << " Y10\n";
+    text << "G0 Z1\n";
+    
+    std::istringstream gfile(text.str());
+    gcode g(gfile);
+    gcode orig = g;
+    size_t saved = g.fit_arcs(0.01);
+    
+    CHECK(saved >= 85);
+    CHECK(g.size() == orig.size() - saved);
+    
+    // Arcs must start and end on the circle and go counterclockwise
+    size_t arcs = 0;
+    point pos;
+    for (const gcmd& c: g) {
+        if (c.letter() == 'G' && c.arg() >= 2 && c.arg() <= 3) {
+            ++arcs;
+            CHECK(c.equals('G', 3));
+            point center = pos + vector(c.delta().x, c.delta().y, 0);
+            CHECK((center - point(10, 10, -0.1)).length() < 1e-3);
+            CHECK(fabs((c.point() - center).length() - 5) < 1e-3);
+        }
+        if (c.point().defined())
+            pos = c.point();
+    }
+    CHECK(arcs >= 1);
+    CHECK(g[g.size() - 1].point() == approx(orig[orig.size() - 1].point()));
+}
+
+TEST_CASE("gcode_split_arcs", "[gcode][arcs]")
+{
+    std::istringstream gfile(R"(
+G0 X15 Y10 Z-0.1
+G3 X5 Y10 Z-0.1 I-5 J0
+G2 X15 Y10 Z-0.1 I5 J0
+)");
+    gcode g(gfile);
+    
+    // Flat surface: arcs stay as they are
+    g.split_arcs([](const point&) { return 0.0; }, 0.01);
+    CHECK(g.size() == 3);
+    
+    // Bumpy one: arcs are split, pieces keep their direction and center
+    g.split_arcs([](const point& pt) { return 0.1 * sin(pt.x); }, 0.01);
+    CHECK(g.size() > 3);
+    point pos;
+    for (const gcmd& c: g) {
+        if (c.equals('G', 2) || c.equals('G', 3)) {
+            point center = pos + vector(c.delta().x, c.delta().y, 0);
+            CHECK(center == approx(point(10, 10, -0.1)));
+        }
+        pos = c.point();
+    }
+    CHECK(g[g.size() - 1].equals('G', 2));
+    CHECK(g[1].equals('G', 3));
+}
@@ -3,6 +3,7 @@
 #include "utility.h"
 #include <catch.hpp>
 #include <random>
+#include <sstream>
 #include "../height_map.h"
 
 template<class F>
@@ -63,3 +64,286 @@ TEST_CASE("hmap_interpolation", "[hmap]")
         CHECK(ipt.z == approx(surface(ipt)));
     }
 }
+
+TEST_CASE("hmap_refine", "[hmap]")
+{
+    // Flat stock with a bump in one corner
+    auto surface = [](const point& pt) { return 0.1 + 0.3 * exp(-(pow(pt.x - 70, 2) + pow(pt.y - 70, 2)) / 200); };
+    bounding_box box({ 0, 0, 0 }, { 80, 80, 0 });
+    height_map h(box, {}, 20);
+    init_height_map(h, surface);
+
+    size_t probes = h.refine(surface, 0.005, []{ return true; });
+    CHECK(h.refined());
+    CHECK(h.defined());
+    // A uniform grid as fine as the finest cells would take 33x33 probes
+    CHECK(probes + 25 < 300);
+
+    std::mt19937 rand;
+    rand.seed(1);
+    std::uniform_real_distribution<double> g(0, 80);
+    double worst = 0;
+    for (size_t i = 0; i != 10000; ++i) {
+        point pt(g(rand), g(rand), 0);
+        worst = std::max(worst, fabs(h(pt).z - surface(pt)));
+    }
+    CHECK(worst < 0.02);
+
+    // Flat far corner stays coarse
+    point flat(5, 5, 0);
+    CHECK(h(flat).z == approx(0.1));
+
+    std::stringstream s;
+    h.save(s);
+    height_map h2(s);
+    CHECK(h2.cell_count() == h.cell_count());
+    for (size_t i = 0; i != 1000; ++i) {
+        point pt(g(rand), g(rand), 0);
+        CHECK(fabs(h2(pt).z - h(pt).z) < 1e-5);
+    }
+}
+
+TEST_CASE("hmap_refine_budget", "[hmap]")
+{
+    auto surface = [](const point& pt) { return sin(pt.x / 5) * cos(pt.y / 7); };
+    bounding_box box({ 0, 0, 0 }, { 60, 40, 0 });
+    height_map h(box, {}, 20);
+    init_height_map(h, surface);
+
+    size_t probes = 0;
+    auto probe = [&](const point& pt) { ++probes; return surface(pt); };
+    CHECK(h.refine(probe, 0.001, [&]{ return probes < 50; }) == probes);
+    // A split measures all of its points, so the budget may be overrun slightly
+    CHECK(probes >= 50);
+    CHECK(probes < 60);
+    CHECK(h.defined());
+}
+
+TEST_CASE("hmap_restrict", "[hmap]")
+{
+    bounding_box box({ 0, 0, 0 }, { 40, 40, 0 });
+    height_map h(box, {});
+
+    // A cut along the bottom edge, on a board with the top left corner cut off
+    std::vector<point> cuts;
+    for (double x = 1; x < 40; x += 1)
+        cuts.push_back(point(x, 5, 0));
+    cuts.push_back(point(5, 35, 0));
+    h.restrict_to(cuts, [](const point& pt) {
+        return pt.x + 40 - pt.y < 10 ? point(pt.x + 5, pt.y - 5, pt.z) : pt;
+    });
+
+    std::vector<size_t> scan = h.scan_points();
+    CHECK(scan.size() == 10 + 4);
+    for (size_t i: scan) {
+        point& pt = *(h.begin() + i);
+        CHECK(pt.x + 40 - pt.y >= 10);
+        pt.z = 1 + pt.x * 0.01;
+    }
+    CHECK(!h.defined());
+    h.fill_gaps();
+    CHECK(h.defined());
+    CHECK(h(point(20, 5, 0)).z == approx(1.2));
+    CHECK(h.measurement(4, 2).z == approx(1.4));
+
+    // Refinement tests only the cells with cuts
+    size_t probes = h.refine([](const point& pt) { return 1 + pt.x * 0.01; }, 0.01, []{ return true; });
+    CHECK(probes == 5);
+    CHECK(!h.refined());
+
+    // The centers measured are kept even though no cell needed splitting
+    CHECK(h.end() - h.begin() == 25 + 5);
+    std::stringstream s;
+    h.save(s);
+    height_map h2(s);
+    CHECK(h2.end() - h2.begin() == 25 + 5);
+    CHECK(h2(point(20, 5, 0)).z == approx(1.2));
+}
+
+TEST_CASE("hmap_triangulated", "[hmap]")
+{
+    auto plane = [](const point& pt) { return 0.5 + pt.x*0.01 - pt.y*0.02; };
+    bounding_box box({ 0, 0, 0 }, { 40, 30, 0 });
+
+    // Grid nodes pushed off the grid by holes do not skew the result
+    height_map h(box, {{{ 20, 10, 0 }, 1.5 }, {{ 10, 20, 0 }, 0.5 }});
+    init_height_map(h, plane);
+    h.set_interpolation(height_map::interpolation::triangulated);
+
+    std::mt19937 rand;
+    rand.seed(1);
+    std::uniform_real_distribution<double> gx(0, 40), gy(0, 30);
+    for (size_t i = 0; i != 1000; ++i) {
+        point pt(gx(rand), gy(rand), 0);
+        CHECK(h(pt).z == approx(plane(pt)));
+    }
+
+    // Scattered points, with lookups falling outside their hull
+    std::vector<point> pts;
+    for (size_t i = 0; i != 200; ++i) {
+        point pt(gx(rand), gy(rand), 0);
+        pts.push_back(point(pt.x, pt.y, plane(pt)));
+    }
+    triangulation tin(pts);
+    CHECK(tin.size() > 300);
+    for (size_t i = 0; i != 1000; ++i) {
+        point pt(gx(rand), gy(rand), 0);
+        CHECK(fabs(tin(pt) - plane(pt)) < 0.2);
+        CHECK(tin(pt) >= plane(point(0, 30, 0)) - 1e-9);
+        CHECK(tin(pt) <= plane(point(40, 0, 0)) + 1e-9);
+    }
+
+    // Interpolation inside the hull is exact for a plane
+    for (size_t i = 0; i != 1000; ++i) {
+        point pt(gx(rand) / 2 + 10, gy(rand) / 2 + 7.5, 0);
+        CHECK(tin(pt) == approx(plane(pt)));
+    }
+}
+
+TEST_CASE("hmap_triangulated_hull", "[hmap]")
+{
+    // Grids with their corners in place and the other nodes pushed about,
+    // those along the edges only inwards, so the hull stays the rectangle
+    auto plane = [](const point& pt) { return 0.5 + pt.x*0.01 - pt.y*0.02; };
+    std::mt19937 rand;
+    rand.seed(1);
+    std::uniform_real_distribution<double> jitter(-2, 2), inwards(0, 2), gx(0, 80), gy(0, 60);
+    
+    for (size_t grid = 0; grid != 20; ++grid) {
+        std::vector<point> pts;
+        for (int y = 0; y <= 6; ++y) {
+            for (int x = 0; x <= 8; ++x) {
+                bool edge_x = x == 0 || x == 8, edge_y = y == 0 || y == 6;
+                point pt(x * 10, y * 10, 0);
+                if (!edge_x || !edge_y) {
+                    pt.x += edge_x ? (x ? -inwards(rand) : inwards(rand)) : jitter(rand);
+                    pt.y += edge_y ? (y ? -inwards(rand) : inwards(rand)) : jitter(rand);
+                }
+                pt.z = plane(pt);
+                pts.push_back(pt);
+            }
+        }
+        triangulation tin(pts);
+        
+        // Linear interpolation is exact all over the hull, gaps would not be
+        size_t wrong = 0;
+        for (size_t i = 0; i != 1000; ++i) {
+            point pt(gx(rand), gy(rand), 0);
+            if (fabs(tin(pt) - plane(pt)) > 1e-9)
+                ++wrong;
+        }
+        CHECK(wrong == 0);
+    }
+}
+
+TEST_CASE("hmap_batch", "[hmap]")
+{
+    auto surface = [](const point& pt) { return sin(pt.x / 5) * cos(pt.y / 7); };
+    bounding_box box({ 0, 0, 0 }, { 60, 40, 0 });
+    height_map h(box, {{{ 20, 20, 0 }, 1 }}, 20);
+    init_height_map(h, surface);
+    h.refine(surface, 0.01, []{ return true; });
+    REQUIRE(h.refined());
+
+    // A zigzag running off the map on both sides
+    std::vector<double> x, y, z;
+    for (double py = -2; py < 42; py += 0.7) {
+        for (double px = -3; px < 63; px += 0.3) {
+            x.push_back(int((py + 2) / 0.7) % 2 ? 60 - px : px);
+            y.push_back(py);
+            z.push_back(-0.1);
+        }
+    }
+
+    for (auto mode: { height_map::interpolation::bilinear, height_map::interpolation::triangulated }) {
+        h.set_interpolation(mode);
+        std::vector<double> zz = z;
+        h.apply(x.size(), x.data(), y.data(), zz.data());
+        size_t mismatches = 0;
+        for (size_t i = 0; i != x.size(); ++i)
+            if (fabs(zz[i] - h(point(x[i], y[i], -0.1)).z) > 1e-9)
+                ++mismatches;
+        CHECK(mismatches == 0);
+    }
+}
+
+TEST_CASE("hmap_bicubic", "[hmap]")
+{
+    auto surface = [](const point& pt) { return 0.1 * sin(pt.x / 15) * cos(pt.y / 20); };
+    bounding_box box({ 0, 0, 0 }, { 60, 40, 0 });
+    height_map h(box, {{{ 20, 10, 0 }, 1 }}, 10);
+    init_height_map(h, surface);
+
+    // Still passes through every measurement, shifted ones included
+    h.set_interpolation(height_map::interpolation::bicubic);
+    for (const point& pt: h)
+        CHECK(h(point(pt.x, pt.y, 0)).z == approx(pt.z));
+
+    std::mt19937 rand;
+    rand.seed(1);
+    std::uniform_real_distribution<double> gx(0, 60), gy(0, 40);
+    double bilinear_err = 0, bicubic_err = 0;
+    for (size_t i = 0; i != 1000; ++i) {
+        point pt(gx(rand), gy(rand), 0);
+        h.set_interpolation(height_map::interpolation::bilinear);
+        bilinear_err = std::max(bilinear_err, fabs(h(pt).z - surface(pt)));
+        h.set_interpolation(height_map::interpolation::bicubic);
+        bicubic_err = std::max(bicubic_err, fabs(h(pt).z - surface(pt)));
+    }
+    CHECK(bicubic_err < bilinear_err / 3);
+
+    // Flat beyond the edges
+    CHECK(h(point(-5, 17, 0)).z == approx(h(point(0, 17, 0)).z));
+    CHECK(h(point(61, 45, 0)).z == approx(h(point(60, 40, 0)).z));
+
+    std::vector<double> x, y, z;
+    for (size_t i = 0; i != 1000; ++i) {
+        x.push_back(gx(rand));
+        y.push_back(gy(rand));
+        z.push_back(0);
+    }
+    h.apply(x.size(), x.data(), y.data(), z.data());
+    for (size_t i = 0; i != x.size(); ++i)
+        CHECK(z[i] == approx(h(point(x[i], y[i], 0)).z));
+
+    // Refinements along the edges stay flat beyond them as well
+    h.refine(surface, 0.0005, []{ return true; });
+    REQUIRE(h.refined());
+    x.clear();
+    y.clear();
+    for (double py = 1; py < 40; py += 3.7) {
+        CHECK(h(point(-5, py, 0)).z == approx(h(point(0, py, 0)).z));
+        CHECK(h(point(65, py, 0)).z == approx(h(point(60, py, 0)).z));
+        x.insert(x.end(), { -5, 65 });
+        y.insert(y.end(), { py, py });
+    }
+    z.assign(x.size(), 0);
+    h.apply(x.size(), x.data(), y.data(), z.data());
+    for (size_t i = 0; i != x.size(); ++i)
+        CHECK(z[i] == approx(h(point(x[i], y[i], 0)).z));
+}
+
+TEST_CASE("hmap_plane", "[hmap]")
+{
+    // A single cell spanning the board, corners shifted away from holes
+    auto plane = [](const point& pt) { return 0.3 + pt.x*0.002 - pt.y*0.001; };
+    bounding_box box({ 0, 0, 0 }, { 60, 40, 0 });
+    height_map h(box, {{{ 0, 0, 0 }, 1 }, {{ 60, 40, 0 }, 0.5 }}, 60);
+    REQUIRE(std::distance(h.begin(), h.end()) == 4);
+    init_height_map(h, plane);
+
+    std::mt19937 rand;
+    rand.seed(1);
+    std::uniform_real_distribution<double> gx(-5, 65), gy(-5, 45);
+    for (size_t i = 0; i != 100; ++i) {
+        point pt(gx(rand), gy(rand), 0);
+        CHECK(h(pt).z == approx(plane(pt)));
+    }
+
+    // Triangulation only holds up within the corners measured
+    h.set_interpolation(height_map::interpolation::triangulated);
+    for (size_t i = 0; i != 100; ++i) {
+        point pt(gx(rand) / 2 + 15, gy(rand) / 2 + 10, 0);
+        CHECK(h(pt).z == approx(plane(pt)));
+    }
+}
@@ -0,0 +1,58 @@
+#include "utility.h"
+#include <catch.hpp>
+#include <sstream>
+#include <numeric>
+#include "../planner.h"
+#include "../gcode.h"
+
+static const machine_limits LIMITS = {
+    { 1000, 1000, 500 },  // mm/min
+    { 10, 10, 10 },       // mm/s^2
+    0.01                  // mm
+};
+
+static double total(const std::vector<double>& times)
+{
+    return std::accumulate(times.begin(), times.end(), 0.0);
+}
+
+static std::vector<double> estimate(const std::string& text)
+{
+    std::istringstream s(text);
+    return motion_planner(LIMITS).estimate(gcode(s), point(0, 0, 0));
+}
+
+TEST_CASE("planner_trapezoid", "[planner]")
+{
+    // 1 s to reach 10 mm/s, 9 s cruising, 1 s to stop
+    REQUIRE(approx(total(estimate("G1 F600 X100 Y0 Z0\n"))) == 11);
+
+    // Rapids are limited by max rate only
+    double v = 1000.0 / 60;
+    REQUIRE(approx(total(estimate("G0 X0 Y100 Z0\n"))) == 100 / v + v / 10);
+
+    // Too short to reach nominal speed: triangular profile
+    REQUIRE(approx(total(estimate("G1 F600 X1 Y0 Z0\n"))) == 2 * sqrt(0.1));
+
+    // Dwell
+    REQUIRE(approx(total(estimate("G4 P2\n"))) == 2);
+}
+
+TEST_CASE("planner_junctions", "[planner]")
+{
+    // Collinear segments do not slow down at junctions
+    std::string line;
+    for (int i = 1; i <= 40; ++i)
+        line += "G1 F600 X" + std::to_string(i * 2.5) + " Y0 Z0\n";
+    auto times = estimate(line);
+    REQUIRE(times.size() == 40);
+    REQUIRE(approx(total(times)) == 11);
+
+    // Right angle corner slows down but does not stop
+    double corner = total(estimate("G1 F600 X50 Y0 Z0\nG1 X50 Y50 Z0\n"));
+    REQUIRE(corner > 11);
+    REQUIRE(corner < 12);
+
+    // Spindle commands drain the planner, forcing a full stop
+    REQUIRE(approx(total(estimate("G1 F600 X50 Y0 Z0\nM5\nG1 X100 Y0 Z0\n"))) == 12);
+}
@@ -14,3 +14,184 @@ TEST_CASE("depth_list_test", "[shapes]")
 }
 
 
+
+static bool on_circle(const polyline& pts, const point& center, double radius)
+{
+    return std::all_of(pts.begin(), pts.end(), [&](const point& pt) {
+        return fabs((pt - center).project_xy().length() - radius) < 1e-6;
+    });
+}
+
+TEST_CASE("shape_path_arcs", "[shapes]")
+{
+    shapes::path c = shapes::circle(10);
+    
+    // A handful of commands instead of one per 0.05 mm
+    std::vector<gcmd> cmds = c.commands();
+    REQUIRE(cmds.size() == 3);
+    CHECK(cmds[0].equals('G', 1));
+    CHECK(cmds[1].equals('G', 3));
+    CHECK(cmds[1].point() == approx(point(-10, 0, 0)));
+    CHECK(cmds[1].delta() == approx(vector(-10, 0, NAN)));
+    CHECK(cmds[2].point() == approx(point(10, 0, 0)));
+    
+    polyline flat = c.flatten();
+    CHECK(flat.size() > 1000);
+    CHECK(on_circle(flat, point::zero(), 10));
+    CHECK(flat.front() == approx(point(10, 0, 0)));
+    CHECK(flat.back() == approx(point(10, 0, 0)));
+    CHECK(flat[flat.size() / 4].y > 9);  // counterclockwise
+    
+    // Going backwards turns arcs the other way
+    polyline rflat = c.reversed().flatten();
+    CHECK(on_circle(rflat, point::zero(), 10));
+    CHECK(rflat[rflat.size() / 4].y < -9);
+    CHECK(c.reversed().commands()[1].equals('G', 2));
+}
+
+TEST_CASE("shape_depth_list_path", "[shapes]")
+{
+    shapes::path b = depth_list(0.5, 1, 0.5)(shapes::box(10, 20, 2));
+    
+    std::vector<gcmd> cmds = b.commands();
+    CHECK(cmds.front().point() == approx(point(0, 2, -0.5)));
+    CHECK(cmds.back().point() == approx(point(0, 2, -1)));
+    
+    size_t arcs = std::count_if(cmds.begin(), cmds.end(), [](const gcmd& c) { return c.arg() == 2 || c.arg() == 3; });
+    CHECK(arcs == 8);
+    // The second layer goes the other way round
+    CHECK(cmds[2].equals('G', 2));
+    CHECK(cmds[cmds.size() - 2].equals('G', 3));
+    
+    polyline flat = b.flatten();
+    for (const point& pt: flat) {
+        CHECK(pt.x > -1e-6);
+        CHECK(pt.x < 10 + 1e-6);
+        CHECK(pt.y > -1e-6);
+        CHECK(pt.y < 20 + 1e-6);
+    }
+    
+    CHECK(shapes::preserves_arcs([](const point& pt) { return point(-pt.y, pt.x, pt.z); }));
+    CHECK(!shapes::preserves_arcs([](const point& pt) { return point(pt.x * 2, pt.y, pt.z); }));
+}
+
+static double distance_to(const point& p, const polyline& pts)
+{
+    double best = 1e9;
+    for (size_t i = 0; i + 1 < pts.size(); ++i) {
+        vector ab = (pts[i+1] - pts[i]).project_xy();
+        double t = (ab * ab > 0) ? std::min(1.0, std::max(0.0, ((p - pts[i]).project_xy() * ab) / (ab * ab))) : 0;
+        best = std::min(best, (p - (pts[i] + ab * t)).project_xy().length());
+    }
+    return best;
+}
+
+TEST_CASE("shape_pocket_box", "[shapes][pocket]")
+{
+    std::vector<shapes::path> paths = shapes::filled_box(10, 20, 2, 1);
+    
+    // Convex: one plunge is enough
+    REQUIRE(paths.size() == 1);
+    polyline pts = paths[0].flatten();
+    
+    // Never closer than the tool radius to the border
+    for (const point& pt: pts) {
+        CHECK(pt.x > 1 - 0.02);
+        CHECK(pt.x < 9 + 0.02);
+        CHECK(pt.y > 1 - 0.02);
+        CHECK(pt.y < 19 + 0.02);
+    }
+    
+    // Every point at least a tool radius away from the border gets cut. With
+    // the stepover at its maximum the middle line is exactly a radius away
+    // from the innermost contour
+    for (double x = 1; x <= 9; x += 0.25)
+        for (double y = 1; y <= 19; y += 0.25)
+            CHECK(distance_to(point(x, y, 0), pts) < 1 + 1e-6);
+    
+    // The last contour finishes along the border
+    const point& last = pts.back();
+    CHECK(fabs(std::min({ last.x, 10 - last.x, last.y, 20 - last.y }) - 1) < 0.02);
+}
+
+TEST_CASE("shape_pocket_ring", "[shapes][pocket]")
+{
+    std::vector<shapes::path> paths = shapes::filled_circle(3, 10, 1, 0.5);
+    REQUIRE(!paths.empty());
+    
+    size_t count = 0;
+    for (const shapes::path& p: paths) {
+        for (const point& pt: p.flatten()) {
+            double r = pt.to_vector().project_xy().length();
+            CHECK(r > 3.5 - 0.02);
+            CHECK(r < 9.5 + 0.02);
+            ++count;
+        }
+    }
+    CHECK(count > 0);
+    
+    // Nothing left uncut around the ring
+    polyline all;
+    for (const shapes::path& p: paths) {
+        polyline pts = p.flatten();
+        all.insert(all.end(), pts.begin(), pts.end());
+    }
+    for (double a = 0; a < 2*M_PI; a += 0.3)
+        for (double r = 3.5; r <= 9.5; r += 0.25)
+            CHECK(distance_to(point(r*cos(a), r*sin(a), 0), all) < 0.5 + 0.01);
+}
+
+TEST_CASE("shape_pocket_links", "[shapes][pocket]")
+{
+    // L-shaped: contours bend around the inner corner and the moves linking
+    // them must stay a tool radius off the walls all along, not just at ends
+    polyline border = { point(0, 0, 0), point(20, 0, 0), point(20, 5, 0), point(5, 5, 0), point(5, 20, 0), point(0, 20, 0) };
+    std::vector<shapes::path> paths = shapes::pocket({ border }, 2, 0.8);
+    REQUIRE(!paths.empty());
+    
+    polyline closed = border;
+    closed.push_back(border.front());
+    for (const shapes::path& p: paths) {
+        polyline pts = p.flatten();
+        for (size_t i = 0; i + 1 < pts.size(); ++i)
+            for (double t = 0; t <= 1; t += 0.05)
+                CHECK(distance_to(pts[i] + (pts[i+1] - pts[i]) * t, closed) > 1 - 0.02);
+    }
+}
+
+TEST_CASE("shape_depth_list_ramp", "[shapes]")
+{
+    depth_list depths(0.5, 1, 0.5);
+
+    // Arcs descend helically, with no separate plunges
+    std::vector<gcmd> cmds = depths.ramp(shapes::circle(5)).commands();
+    CHECK(cmds.front().point().z == approx(0));
+    CHECK(cmds.back().point().z == approx(-1));
+    for (size_t i = 1; i < cmds.size(); ++i) {
+        CHECK((cmds[i].arg() == 2 || cmds[i].arg() == 3));
+        CHECK(cmds[i].point().z <= cmds[i-1].point().z + 1e-9);
+    }
+
+    polyline flat = depths.ramp(shapes::box(10, 20, 2)).flatten();
+    double len = shapes::box(10, 20, 2).length();
+    double descent = 0;
+    for (size_t i = 1; i < flat.size(); ++i) {
+        vector v = flat[i] - flat[i-1];
+        CHECK(v.z <= 1e-9);
+        CHECK(v.project_xy().length() > 1e-9);
+        descent = std::max(descent, -v.z / v.project_xy().length());
+    }
+    CHECK(flat.back().z == approx(-1));
+    // Each depth step spreads over a full lap
+    CHECK(fabs(descent * len - 0.5) < 1e-3);
+
+    // The last lap is flat
+    auto last = std::find_if(flat.begin(), flat.end(), [](const point& pt) { return pt.z < -1 + 1e-9; });
+    CHECK(fabs(shapes::path(polyline(last, flat.end())).length() - len) < 0.01);
+
+    // Open paths are still cut layer by layer
+    std::vector<gcmd> open = depths.ramp(shapes::segment({ 10, 0, 0 })).commands();
+    REQUIRE(open.size() == 4);
+    CHECK(open[0].point() == approx(point(0, 0, -0.5)));
+    CHECK(open[3].point() == approx(point(0, 0, -1)));
+}
@@ -0,0 +1,87 @@
+#include "../toolpath.h"
+#include "../gcode.h"
+#include "../height_map.h"
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <functional>
+
+static double measure(const std::function<void()>& f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+    static const size_t POINTS = 1000000;
+
+    bounding_box box({ 0, 0, 0 }, { 100, 80, 0 });
+    height_map h(box, {});
+    for (point& pt: h)
+        pt.z = pt.x*0.001 + pt.y*0.002;
+    orientation o({ 0, 0, 0 }, { 10, 10, 0 }, vector::axis::x().rotate(0.01));
+
+    std::mt19937 rand;
+    rand.seed(1);
+    std::uniform_real_distribution<double> gx(0, 100), gy(0, 80);
+    std::vector<gcmd> cmds;
+    for (size_t i = 0; i != POINTS; ++i)
+        cmds.push_back(gcmd("G1", point(gx(rand), gy(rand), -0.05)));
+    gcode job(cmds.begin(), cmds.end());
+
+    gcode scalar(job);
+    double t_scalar = measure([&]{
+        scalar.xform_by(h);
+        scalar.xform_by(o);
+        scalar.xform_by([](const point& pt) { return pt + vector::axis::z(0.1); });
+        scalar.bounding_box();
+    });
+
+    gcode batch(job);
+    double t_load = 0, t_kernels = 0, t_store = 0;
+    t_load = measure([&]{
+        toolpath tp(batch);
+        t_kernels = measure([&]{
+            tp.apply(h);
+            tp.orient(o);
+            tp.shift_z(0.1);
+            tp.bounding_box();
+        });
+        t_store = measure([&]{ tp.store(batch); });
+    }) - t_kernels - t_store;
+
+    std::cout << POINTS << " points" << std::endl
+              << "gcode::xform_by:       " << t_scalar << " ms" << std::endl
+              << "toolpath (" << toolpath::kernel_name() << "): "
+              << t_load + t_kernels + t_store << " ms"
+              << " (load " << t_load << ", kernels " << t_kernels << ", store " << t_store << ")"
+              << std::endl;
+
+    // A raster layer, where consecutive points share cells, over a refined map
+    height_map r(box, {}, 20);
+    auto bumps = [](const point& pt) { return 0.05 * sin(pt.x / 7) * cos(pt.y / 5); };
+    for (point& pt: r)
+        pt.z = bumps(pt);
+    r.refine(bumps, 0.002, []{ return true; });
+
+    std::vector<double> lx, ly, lz;
+    for (size_t i = 0; i != POINTS; ++i) {
+        size_t row = i / 1000, col = i % 1000;
+        lx.push_back((row % 2 ? 999 - col : col) * 0.1);
+        ly.push_back(row * 0.08);
+        lz.push_back(-0.05);
+    }
+
+    std::vector<double> single(lz), batch_z(lz);
+    double t_single = measure([&]{
+        for (size_t i = 0; i != POINTS; ++i)
+            single[i] = r(point(lx[i], ly[i], single[i])).z;
+    });
+    double t_batch = measure([&]{ r.apply(POINTS, lx.data(), ly.data(), batch_z.data()); });
+
+    std::cout << "refined map (" << r.cell_count() << " cells), per point: " << t_single << " ms"
+              << ", batch: " << t_batch << " ms" << std::endl;
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include "utility.h"
+#include <catch.hpp>
+#include <random>
+#include <sstream>
+#include "../toolpath.h"
+#include "../gcode.h"
+#include "../height_map.h"
+
+static gcode random_gcode(size_t count, const bounding_box& box)
+{
+    std::mt19937 rand;
+    rand.seed(1);
+    std::uniform_real_distribution<double> gx(box.bottom_left().x, box.top_right().x);
+    std::uniform_real_distribution<double> gy(box.bottom_left().y, box.top_right().y);
+    std::uniform_real_distribution<double> gz(-1, 1);
+
+    std::vector<gcmd> cmds;
+    cmds.push_back(gcmd::parse(point(), "M3"));
+    for (size_t i = 0; i != count; ++i)
+        cmds.push_back(gcmd("G1", point(gx(rand), gy(rand), gz(rand))));
+    cmds.push_back(gcmd::parse(point(), "M5"));
+    return gcode(cmds.begin(), cmds.end());
+}
+
+TEST_CASE("toolpath_xform", "[toolpath][xform]")
+{
+    bounding_box box({ -10, -10, 0 }, { 20, 30, 0 });
+    height_map h(box, {{{ 5, 5, 0 }, 1 }});
+    for (point& pt: h)
+        pt.z = pt.x*0.01 - pt.y*0.02 + sin(pt.x);
+
+    orientation o({ 5, 0, 0 }, { 1, 2, 0 }, vector::axis::x().rotate(deg(30)));
+    o.set_hmirror(5);
+
+    gcode expected = random_gcode(1001, box);
+    gcode actual(expected);
+
+    expected.xform_by(h);
+    expected.xform_by(o);
+    expected.xform_by([](const point& pt) { return pt + vector::axis::z(0.1); });
+
+    toolpath tp(actual);
+    REQUIRE(tp.size() == 1001);
+    tp.apply(h);
+    tp.orient(o);
+    tp.shift_z(0.1);
+    tp.store(actual);
+
+    REQUIRE(actual.size() == expected.size());
+    for (size_t i = 0; i != actual.size(); ++i)
+        CHECK(actual[i].point() == approx(expected[i].point()));
+
+    auto bbox = tp.bounding_box();
+    CHECK(bbox.bottom_left() == approx(expected.bounding_box().bottom_left()));
+    CHECK(bbox.top_right() == approx(expected.bounding_box().top_right()));
+}
+
+TEST_CASE("toolpath_arcs", "[toolpath][xform]")
+{
+    std::istringstream gfile(R"(
+G0 X10 Y0 Z0
+G3 X15 Y5 I0 J5
+)");
+    gcode g(gfile);
+    orientation o({ 5, 0, 0 }, { 0, 0, 0 }, vector::axis::x().rotate(deg(30)));
+
+    toolpath tp(g);
+    tp.orient(o);
+    tp.store(g);
+
+    CHECK(g[1].point() == approx(point(2.5*(2*sqrt(3)-1), 2.5*(sqrt(3)+2), 0)));
+    CHECK(g[1].delta() == approx(vector(-2.5, 2.5*sqrt(3), NAN)));
+}
+
+TEST_CASE("toolpath_mirrored_arcs", "[toolpath][xform]")
+{
+    std::istringstream gfile(R"(
+G0 X10 Y0 Z0
+G3 X15 Y5 I0 J5
+G2 X20 Y10 I5 J0
+)");
+    gcode g(gfile);
+    gcode expected = g;
+    orientation o({ 0, 0, 0 }, { 0, 0, 0 }, vector::axis::x());
+    o.set_hmirror(10);
+    expected.xform_by(o);
+
+    toolpath tp(g);
+    tp.orient(o);
+    tp.store(g);
+
+    // Mirroring turns counterclockwise arcs into clockwise ones and vice versa
+    CHECK(g[1].equals('G', 2));
+    CHECK(g[2].equals('G', 3));
+    CHECK(g[1].delta() == approx(vector(0, 5, NAN)));
+    CHECK(expected[1].equals('G', 2));
+    CHECK(expected[2].equals('G', 3));
+}
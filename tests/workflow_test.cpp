@@ -4,6 +4,7 @@
 #include <catch.hpp>
 #include <random>
 #include "../workflow.h"
+#include "../probing.h"
 
 static const char* BORDER = R"(
 M3
@@ -75,3 +76,195 @@ G0 Z1
     CHECK(drills[3].center == approx(point(8, 2, 0)));
     CHECK(drills[3].radius == approx(0.4));
 }
+
+TEST_CASE("plan_drill", "[workflow][optimize]")
+{
+    static const char* DRILL = R"(
+G90
+T1
+M5
+M6
+(MSG, Change to tool dia=0.4)
+M0
+M3
+G0 X2 Y2 Z1
+G1 Z-1.8 F75
+G1 Z0
+G0 Z1
+G0 X9 Y2
+G1 Z-1.8
+G1 Z0
+G0 Z1
+T2
+M5
+M6
+(MSG, Change to tool dia=0.8)
+M0
+M3
+G0 X6 Y2 Z1
+G1 Z-1.8
+G1 Z0
+G0 Z1
+T3
+M5
+M6
+(MSG, Change to tool dia=0.4)
+M0
+M3
+G0 X4 Y2 Z1
+G1 Z-1.8
+G1 Z0
+G0 Z1
+M5
+)";
+    
+    workflow w;
+    w.set_border(parse(BORDER));
+    w.set_drill(parse(DRILL));
+    w.plan_drill();
+    
+    CHECK(w.drill_tools_merged() == 1);
+    CHECK(w.drill_travel().before == approx(7 + 3 + 2));
+    CHECK(w.drill_travel().after == approx(2 + 5 + 3));
+    
+    std::vector<circular_area> drills = w.drills();
+    REQUIRE(drills.size() >= 4);
+    CHECK(drills[0].center == approx(point(2, 2, 0)));
+    CHECK(drills[1].center == approx(point(4, 2, 0)));
+    CHECK(drills[2].center == approx(point(9, 2, 0)));
+    CHECK(drills[2].radius == approx(0.2));
+    CHECK(drills[3].center == approx(point(6, 2, 0)));
+    CHECK(drills[3].radius == approx(0.4));
+    
+    // The merged tool's header leaves the spindle running between holes
+    std::vector<std::string> cmds;
+    for (const gcmd& c: w.drill_gcode())
+        cmds.push_back(lexical_cast<std::string>(c));
+    std::vector<size_t> plunges;
+    for (size_t i = 0; i != cmds.size(); ++i)
+        if (cmds[i].find("Z-1.8") != std::string::npos)
+            plunges.push_back(i);
+    REQUIRE(plunges.size() == 4);
+    for (size_t i = plunges[0]; i != plunges[2]; ++i)
+        CHECK((cmds[i] != "M3" && cmds[i] != "M5" && cmds[i].find("G4") == std::string::npos));
+    CHECK(std::count(cmds.begin(), cmds.end(), "M3") == 2);
+    CHECK(std::count(cmds.begin(), cmds.end(), "M5") == 3);
+}
+
+TEST_CASE("plan_drill_empty_block", "[workflow][optimize]")
+{
+    // The last tool drills nothing, but its block still stops the spindle
+    static const char* DRILL = R"(
+G90
+T1
+M5
+M6
+(MSG, Change to tool dia=0.4)
+M0
+M3
+G0 X2 Y2 Z1
+G1 Z-1.8 F75
+G1 Z0
+G0 Z1
+T2
+M5
+M6
+(MSG, Change to tool dia=0.4)
+M0
+M3
+(MSG, Done)
+M5
+)";
+    
+    workflow w;
+    w.set_border(parse(BORDER));
+    w.set_drill(parse(DRILL));
+    w.plan_drill();
+    CHECK(w.drill_tools_merged() == 1);
+    
+    std::vector<std::string> cmds;
+    for (const gcmd& c: w.drill_gcode())
+        cmds.push_back(lexical_cast<std::string>(c));
+    CHECK(std::count(cmds.begin(), cmds.end(), "M6") == 1);
+    REQUIRE(!cmds.empty());
+    CHECK(cmds.back() == "M5");
+    CHECK(std::any_of(cmds.begin(), cmds.end(), [](const std::string& s) { return s.find("Done") != std::string::npos; }));
+}
+
+TEST_CASE("predict_surface", "[workflow][probe]")
+{
+    auto surface = [](double x, double y) { return 1 + 0.01*x - 0.02*y; };
+    std::mt19937 rand;
+    rand.seed(1);
+    std::uniform_real_distribution<double> g(-10, 10);
+    std::normal_distribution<double> noise(0, 0.01);
+
+    std::vector<point> measured;
+    for (size_t i = 0; i != 200; ++i) {
+        double x = g(rand), y = g(rand);
+        measured.push_back(point(x, y, surface(x, y) + noise(rand)));
+    }
+
+    double rms = 0;
+    double z = predict_surface(measured, point(3, -4, 0), 20, rms);
+    CHECK(fabs(z - surface(3, -4)) < 0.005);
+    CHECK(rms > 0.008);
+    CHECK(rms < 0.012);
+
+    // Out of reach of everything
+    CHECK(std::isnan(predict_surface(measured, point(100, 100, 0), 5, rms)));
+
+    // Four corners of a square leave one degree of freedom for the bent one
+    std::vector<point> square = { { 0, 0, 0 }, { 1, 0, 0 }, { 0, 1, 0 }, { 1, 1, 0.4 } };
+    CHECK(predict_surface(square, point(0.5, 0.5, 0), 2, rms) == approx(0.1));
+    CHECK(rms == approx(0.2));
+
+    // Three points fit exactly and say nothing about the fit
+    square.pop_back();
+    CHECK(std::isnan(predict_surface(square, point(0.5, 0.5, 0), 2, rms)));
+
+    // Nor do points on a line, however many
+    std::vector<point> line;
+    for (size_t i = 0; i != 10; ++i)
+        line.push_back(point(i, i, 0.1 * i));
+    CHECK(std::isnan(predict_surface(line, point(3, 4, 0), 20, rms)));
+}
+
+TEST_CASE("surface_top", "[workflow][probe]")
+{
+    std::vector<point> measured = { { 0, 0, 0.1 }, { 5, 0.5, 0.3 }, { 5, 3, 0.9 }, { 10, 0, 0.2 } };
+    CHECK(surface_top(measured, point(0, 0, 0), point(10, 0, 0), 1) == approx(0.3));
+    CHECK(surface_top(measured, point(0, 0, 0), point(10, 0, 0), 4) == approx(0.9));
+    // Nothing measured near the target
+    CHECK(std::isnan(surface_top(measured, point(0, 0, 0), point(0, 10, 0), 1)));
+}
+
+TEST_CASE("move_inside", "[workflow][probe]")
+{
+    polyline square = { { 0, 0, 0 }, { 10, 0, 0 }, { 10, 10, 0 }, { 0, 10, 0 }, { 0, 0, 0 } };
+    CHECK(move_inside(square, point(5, 5, 1), 1) == approx(point(5, 5, 1)));
+    CHECK(move_inside(square, point(5, 0.5, 1), 1) == approx(point(5, 1, 1)));
+    CHECK(move_inside(square, point(5, -2, 1), 1) == approx(point(5, 1, 1)));
+    CHECK(move_inside(square, point(12, 5, 1), 1) == approx(point(9, 5, 1)));
+}
+
+TEST_CASE("trace_cuts", "[workflow][probe]")
+{
+    static const char* CUT = R"(
+G0 Z2
+G0 X0 Y0 Z2
+G1 Z-1
+G1 X10 Y0
+G1 X10 Y10
+G1 X0 Y10
+G1 X0 Y0
+G0 Z2
+)";
+    std::vector<point> pts = trace_cuts(*parse(CUT), 1);
+    REQUIRE(pts.size() >= 40);
+    CHECK(pts.front().project_xy() == approx(point(0, 0, 0)));
+    CHECK(pts.back().project_xy() == approx(point(0, 0, 0)));
+    for (size_t i = 0; i + 1 < pts.size(); ++i)
+        CHECK((pts[i+1] - pts[i]).project_xy().length() <= 1 + 1e-9);
+    CHECK(std::any_of(pts.begin(), pts.end(), [](const point& p) { return (p - point(10, 10, p.z)).length() < 1e-9; }));
+}
@@ -0,0 +1,292 @@
+#include "toolpath.h"
+#include "gcode.h"
+#include "height_map.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#if defined(__AVX__) || defined(__SSE2__)
+# include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+# include <arm_neon.h>
+#endif
+
+namespace {
+
+// A pack of doubles processed at once. min() and max() return the second
+// argument whenever the first one is NaN, like minpd/maxpd do.
+
+struct scalar_pack {
+    static constexpr size_t width = 1;
+    static constexpr const char* name = "scalar";
+    double v;
+
+    static scalar_pack load(const double* p) { return { *p }; }
+    static scalar_pack broadcast(double d) { return { d }; }
+    void store(double* p) const { *p = v; }
+
+    friend scalar_pack operator + (scalar_pack a, scalar_pack b) { return { a.v + b.v }; }
+    friend scalar_pack operator - (scalar_pack a, scalar_pack b) { return { a.v - b.v }; }
+    friend scalar_pack operator * (scalar_pack a, scalar_pack b) { return { a.v * b.v }; }
+    friend scalar_pack operator / (scalar_pack a, scalar_pack b) { return { a.v / b.v }; }
+    friend scalar_pack min(scalar_pack a, scalar_pack b) { return { a.v < b.v ? a.v : b.v }; }
+    friend scalar_pack max(scalar_pack a, scalar_pack b) { return { a.v > b.v ? a.v : b.v }; }
+    friend scalar_pack floor(scalar_pack a) { return { std::floor(a.v) }; }
+};
+
+#if defined(__AVX__)
+
+struct simd_pack {
+    static constexpr size_t width = 4;
+    static constexpr const char* name = "avx";
+    __m256d v;
+
+    static simd_pack load(const double* p) { return { _mm256_loadu_pd(p) }; }
+    static simd_pack broadcast(double d) { return { _mm256_set1_pd(d) }; }
+    void store(double* p) const { _mm256_storeu_pd(p, v); }
+
+    friend simd_pack operator + (simd_pack a, simd_pack b) { return { _mm256_add_pd(a.v, b.v) }; }
+    friend simd_pack operator - (simd_pack a, simd_pack b) { return { _mm256_sub_pd(a.v, b.v) }; }
+    friend simd_pack operator * (simd_pack a, simd_pack b) { return { _mm256_mul_pd(a.v, b.v) }; }
+    friend simd_pack operator / (simd_pack a, simd_pack b) { return { _mm256_div_pd(a.v, b.v) }; }
+    friend simd_pack min(simd_pack a, simd_pack b) { return { _mm256_min_pd(a.v, b.v) }; }
+    friend simd_pack max(simd_pack a, simd_pack b) { return { _mm256_max_pd(a.v, b.v) }; }
+    friend simd_pack floor(simd_pack a) { return { _mm256_floor_pd(a.v) }; }
+};
+
+#elif defined(__SSE2__)
+
+struct simd_pack {
+    static constexpr size_t width = 2;
+    static constexpr const char* name = "sse2";
+    __m128d v;
+
+    static simd_pack load(const double* p) { return { _mm_loadu_pd(p) }; }
+    static simd_pack broadcast(double d) { return { _mm_set1_pd(d) }; }
+    void store(double* p) const { _mm_storeu_pd(p, v); }
+
+    friend simd_pack operator + (simd_pack a, simd_pack b) { return { _mm_add_pd(a.v, b.v) }; }
+    friend simd_pack operator - (simd_pack a, simd_pack b) { return { _mm_sub_pd(a.v, b.v) }; }
+    friend simd_pack operator * (simd_pack a, simd_pack b) { return { _mm_mul_pd(a.v, b.v) }; }
+    friend simd_pack operator / (simd_pack a, simd_pack b) { return { _mm_div_pd(a.v, b.v) }; }
+    friend simd_pack min(simd_pack a, simd_pack b) { return { _mm_min_pd(a.v, b.v) }; }
+    friend simd_pack max(simd_pack a, simd_pack b) { return { _mm_max_pd(a.v, b.v) }; }
+
+    friend simd_pack floor(simd_pack a)
+    {
+        // Only used on values already clamped to the grid, so int32 truncation is enough
+        __m128d t = _mm_cvtepi32_pd(_mm_cvttpd_epi32(a.v));
+        return { _mm_sub_pd(t, _mm_and_pd(_mm_cmpgt_pd(t, a.v), _mm_set1_pd(1))) };
+    }
+};
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+struct simd_pack {
+    static constexpr size_t width = 2;
+    static constexpr const char* name = "neon";
+    float64x2_t v;
+
+    static simd_pack load(const double* p) { return { vld1q_f64(p) }; }
+    static simd_pack broadcast(double d) { return { vdupq_n_f64(d) }; }
+    void store(double* p) const { vst1q_f64(p, v); }
+
+    friend simd_pack operator + (simd_pack a, simd_pack b) { return { vaddq_f64(a.v, b.v) }; }
+    friend simd_pack operator - (simd_pack a, simd_pack b) { return { vsubq_f64(a.v, b.v) }; }
+    friend simd_pack operator * (simd_pack a, simd_pack b) { return { vmulq_f64(a.v, b.v) }; }
+    friend simd_pack operator / (simd_pack a, simd_pack b) { return { vdivq_f64(a.v, b.v) }; }
+    friend simd_pack min(simd_pack a, simd_pack b) { return { vminnmq_f64(a.v, b.v) }; }
+    friend simd_pack max(simd_pack a, simd_pack b) { return { vmaxnmq_f64(a.v, b.v) }; }
+    friend simd_pack floor(simd_pack a) { return { vrndmq_f64(a.v) }; }
+};
+
+#else
+
+// 32-bit ARM NEON has no double precision lanes, so armhf runs scalar code.
+typedef scalar_pack simd_pack;
+
+#endif
+
+
+// Each kernel processes [i, n) in steps of P::width and returns
+// the index it stopped at; the tail is then finished by scalar_pack.
+
+template<class P>
+size_t affine_kernel(size_t i, size_t n, double* x, double* y, double* z, const double* a, const double* b)
+{
+    P a00 = P::broadcast(a[0]), a01 = P::broadcast(a[1]), a10 = P::broadcast(a[2]), a11 = P::broadcast(a[3]);
+    P bx = P::broadcast(b[0]), by = P::broadcast(b[1]), bz = P::broadcast(b[2]);
+
+    for (; i + P::width <= n; i += P::width) {
+        P px = P::load(x + i), py = P::load(y + i);
+        (a00*px + a01*py + bx).store(x + i);
+        (a10*px + a11*py + by).store(y + i);
+        (P::load(z + i) + bz).store(z + i);
+    }
+    return i;
+}
+
+template<class P>
+size_t shift_kernel(size_t i, size_t n, double* z, double dz)
+{
+    P d = P::broadcast(dz);
+    for (; i + P::width <= n; i += P::width)
+        (P::load(z + i) + d).store(z + i);
+    return i;
+}
+
+template<class P>
+size_t bounds_kernel(size_t i, size_t n, const double* x, const double* y, double* bounds)
+{
+    P minx = P::broadcast(bounds[0]), miny = P::broadcast(bounds[1]);
+    P maxx = P::broadcast(bounds[2]), maxy = P::broadcast(bounds[3]);
+
+    for (; i + P::width <= n; i += P::width) {
+        P px = P::load(x + i), py = P::load(y + i);
+        minx = min(px, minx);
+        miny = min(py, miny);
+        maxx = max(px, maxx);
+        maxy = max(py, maxy);
+    }
+
+    double lanes[4][P::width];
+    minx.store(lanes[0]);
+    miny.store(lanes[1]);
+    maxx.store(lanes[2]);
+    maxy.store(lanes[3]);
+    for (size_t k = 0; k != P::width; ++k) {
+        bounds[0] = std::min(bounds[0], lanes[0][k]);
+        bounds[1] = std::min(bounds[1], lanes[1][k]);
+        bounds[2] = std::max(bounds[2], lanes[2][k]);
+        bounds[3] = std::max(bounds[3], lanes[3][k]);
+    }
+    return i;
+}
+
+// Same interpolation as height_map::cell::z(), with the coefficients of
+// each lane's cell gathered from the map's precomputed table.
+template<class P>
+size_t height_map_kernel(size_t i, size_t n, const double* x, const double* y, double* z, const height_map& h)
+{
+    const size_t W = P::width;
+    unsigned nx = h.cell_count_x(), ny = h.cell_count_y();
+    P x0 = P::broadcast(h.bounding_box().bottom_left().x);
+    P y0 = P::broadcast(h.bounding_box().bottom_left().y);
+    P inv_cx = P::broadcast(h.inv_cell_size_x());
+    P inv_cy = P::broadcast(h.inv_cell_size_y());
+    P zero = P::broadcast(0);
+    P max_ix = P::broadcast(nx - 1), max_iy = P::broadcast(ny - 1);
+
+    double ix[W], iy[W];
+    double c[10][W];
+
+    for (; i + W <= n; i += W) {
+        P px = P::load(x + i), py = P::load(y + i);
+        floor(min(max((px - x0) * inv_cx, zero), max_ix)).store(ix);
+        floor(min(max((py - y0) * inv_cy, zero), max_iy)).store(iy);
+
+        for (size_t k = 0; k != W; ++k) {
+            const height_map::cell& cell = h.grid_cell(size_t(ix[k]), size_t(iy[k]));
+            const double* coefs[10] = {
+                &cell.lx, &cell.ly, &cell.lz, &cell.ldx, &cell.ldz,
+                &cell.rx, &cell.ry, &cell.rz, &cell.rdx, &cell.rdz
+            };
+            for (size_t j = 0; j != 10; ++j)
+                c[j][k] = *coefs[j];
+        }
+
+        P dl = py - P::load(c[1]);
+        P ex = P::load(c[0]) + P::load(c[3]) * dl;
+        P ez = P::load(c[2]) + P::load(c[4]) * dl;
+
+        P dr = py - P::load(c[6]);
+        P fx = P::load(c[5]) + P::load(c[8]) * dr;
+        P fz = P::load(c[7]) + P::load(c[9]) * dr;
+
+        P mz = ez + (fz - ez) * ((px - ex) / (fx - ex));
+        (P::load(z + i) + mz).store(z + i);
+    }
+    return i;
+}
+
+} // namespace
+
+
+toolpath::toolpath(const gcode& gc)
+{
+    for (const gcmd& cmd: gc)
+        if (cmd.point().any_defined())
+            push_back(cmd.point());
+}
+
+void toolpath::orient(const orientation& o)
+{
+    // Orientation is affine, so three samples recover it exactly
+    point b = o(point::zero());
+    vector ex = o(point(1, 0, 0)) - b;
+    vector ey = o(point(0, 1, 0)) - b;
+
+    double a[4] = { ex.x, ey.x, ex.y, ey.y };
+    double bv[3] = { b.x, b.y, b.z };
+
+    size_t i = affine_kernel<simd_pack>(0, size(), x_.data(), y_.data(), z_.data(), a, bv);
+    affine_kernel<scalar_pack>(i, size(), x_.data(), y_.data(), z_.data(), a, bv);
+
+    double lin[4] = {
+        a[0]*lin_[0] + a[1]*lin_[2], a[0]*lin_[1] + a[1]*lin_[3],
+        a[2]*lin_[0] + a[3]*lin_[2], a[2]*lin_[1] + a[3]*lin_[3]
+    };
+    std::copy(lin, lin + 4, lin_);
+}
+
+void toolpath::apply(const height_map& h)
+{
+    // The kernels only do bilinear lookups within an unsplit grid
+    if (h.refined() || h.interpolation_mode() != height_map::interpolation::bilinear) {
+        h.apply(size(), x_.data(), y_.data(), z_.data());
+        return;
+    }
+    size_t i = height_map_kernel<simd_pack>(0, size(), x_.data(), y_.data(), z_.data(), h);
+    height_map_kernel<scalar_pack>(i, size(), x_.data(), y_.data(), z_.data(), h);
+}
+
+void toolpath::shift_z(double dz)
+{
+    size_t i = shift_kernel<simd_pack>(0, size(), z_.data(), dz);
+    shift_kernel<scalar_pack>(i, size(), z_.data(), dz);
+}
+
+::bounding_box toolpath::bounding_box() const
+{
+    static const double INF = std::numeric_limits<double>::infinity();
+    double bounds[4] = { INF, INF, -INF, -INF };
+
+    size_t i = bounds_kernel<simd_pack>(0, size(), x_.data(), y_.data(), bounds);
+    bounds_kernel<scalar_pack>(i, size(), x_.data(), y_.data(), bounds);
+
+    if (bounds[0] > bounds[2] || bounds[1] > bounds[3])
+        return ::bounding_box();
+    return ::bounding_box({ bounds[0], bounds[1], 0 }, { bounds[2], bounds[3], 0 });
+}
+
+void toolpath::store(gcode& gc) const
+{
+    size_t idx = 0;
+    for (gcmd& cmd: gc) {
+        if (cmd.point().any_defined()) {
+            if (idx == size())
+                throw std::logic_error("toolpath::store(): gcode does not match toolpath");
+            cmd.set_point((*this)[idx++]);
+        }
+
+        const vector& d = cmd.delta();
+        if (d.any_defined()) {
+            cmd.set_delta({ lin_[0]*d.x + lin_[1]*d.y, lin_[2]*d.x + lin_[3]*d.y, d.z });
+            // Mirroring reverses the direction of arcs
+            if (lin_[0]*lin_[3] - lin_[1]*lin_[2] < 0 && (cmd.equals('G', 2) || cmd.equals('G', 3)))
+                cmd.set_cmd(cmd.equals('G', 2) ? "G3" : "G2");
+        }
+    }
+}
+
+const char* toolpath::kernel_name() { return simd_pack::name; }
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "geom.h"
+#include <vector>
+#include <cstddef>
+
+class gcode;
+class height_map;
+
+// Structure-of-arrays copy of all points of a gcode, so that per-point
+// transformations run in bulk (SSE/AVX on x86, NEON on aarch64, scalar elsewhere)
+// instead of going through gcmd::xform_by() one command at a time.
+class toolpath {
+public:
+    toolpath() {}
+    explicit toolpath(const gcode& gc);
+
+    size_t size() const { return x_.size(); }
+    point operator[](size_t idx) const { return { x_[idx], y_[idx], z_[idx] }; }
+    void push_back(const point& pt) { x_.push_back(pt.x); y_.push_back(pt.y); z_.push_back(pt.z); }
+
+    void orient(const orientation& o);
+    void apply(const height_map& h);
+    void shift_z(double dz);
+
+    ::bounding_box bounding_box() const;
+
+    // Writes points back into the gcode this toolpath was built from.
+    // Arc offsets get the linear part of all orientations applied so far.
+    void store(gcode& gc) const;
+
+    static const char* kernel_name();
+
+private:
+    std::vector<double> x_, y_, z_;
+    double lin_[4] = { 1, 0, 0, 1 };
+};
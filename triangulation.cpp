@@ -0,0 +1,238 @@
+#include "triangulation.h"
+#include <algorithm>
+#include <map>
+#include <set>
+#include <stdexcept>
+
+triangulation::triangulation(std::vector<point> pts)
+{
+    // Coincident points would make degenerate triangles
+    std::sort(pts.begin(), pts.end(), [](const point& a, const point& b) { return a.x < b.x || (a.x == b.x && a.y < b.y); });
+    for (const point& pt: pts) {
+        bool dup = false;
+        for (auto i = pts_.rbegin(); i != pts_.rend() && pt.x - i->x < 1e-6; ++i)
+            dup = dup || (pt - *i).project_xy().length() < 1e-6;
+        if (!dup)
+            pts_.push_back(pt);
+    }
+    if (pts_.size() < 3)
+        throw std::runtime_error("too few points to triangulate");
+
+    for (const point& pt: pts_)
+        bbox_.extend(pt);
+
+    // Bowyer-Watson, starting from a triangle enclosing everything
+    size_t n = pts_.size();
+    point c = bbox_.center();
+    double r = std::max(bbox_.size().x, bbox_.size().y) * 10 + 1;
+    pts_.push_back(c + vector(-2*r, -r, 0));
+    pts_.push_back(c + vector(2*r, -r, 0));
+    pts_.push_back(c + vector(0, 2*r, 0));
+    tris_.push_back(make_triangle(n, n+1, n+2));
+
+    for (size_t i = 0; i != n; ++i) {
+        const point& pt = pts_[i];
+
+        // Edges of the cavity left by triangles whose circles contain `pt`;
+        // those shared by two removed triangles are internal to it
+        std::map<std::pair<size_t, size_t>, int> edges;
+        std::vector<triangle> kept;
+        for (const triangle& t: tris_) {
+            if ((pt - t.center).project_xy().length() < t.r) {
+                for (size_t k = 0; k != 3; ++k)
+                    ++edges[std::minmax(t.v[k], t.v[(k+1) % 3])];
+            } else {
+                kept.push_back(t);
+            }
+        }
+        for (const auto& e: edges)
+            if (e.second == 1)
+                kept.push_back(make_triangle(e.first.first, e.first.second, i));
+        tris_.swap(kept);
+    }
+
+    tris_.erase(
+        std::remove_if(tris_.begin(), tris_.end(), [n](const triangle& t) {
+            return t.v[0] >= n || t.v[1] >= n || t.v[2] >= n;
+        }),
+        tris_.end()
+    );
+    pts_.resize(n);
+    if (tris_.empty())
+        throw std::runtime_error("points are all in a line");
+
+    fill_hull();
+    build_buckets();
+}
+
+// Triangles through the super triangle's corners may have been the only
+// ones covering parts of the convex hull next to its edges. The boundary
+// left has dents where it turns right (going counterclockwise); each one
+// is closed by a triangle across it until the boundary is convex.
+void triangulation::fill_hull()
+{
+    auto cross = [this](size_t a, size_t b, size_t c) {
+        vector ab = (pts_[b] - pts_[a]).project_xy(), bc = (pts_[c] - pts_[b]).project_xy();
+        return ab.x * bc.y - ab.y * bc.x;
+    };
+
+    // Boundary edges, directed so that the triangulation is on their left
+    std::set<std::pair<size_t, size_t>> inner, boundary;
+    for (triangle& t: tris_) {
+        if (cross(t.v[0], t.v[1], t.v[2]) < 0)
+            std::swap(t.v[1], t.v[2]);
+        for (size_t k = 0; k != 3; ++k)
+            inner.insert({ t.v[k], t.v[(k+1) % 3] });
+    }
+    for (const auto& e: inner)
+        if (!inner.count({ e.second, e.first }))
+            boundary.insert(e);
+
+    // Dents shallower than this are taken for collinear points
+    double scale = std::max(bbox_.size().x, bbox_.size().y);
+    double min_cross = scale * scale * 1e-12;
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto e = boundary.begin(); e != boundary.end();) {
+            size_t a = e->first, b = e->second;
+            auto next = boundary.lower_bound({ b, 0 });
+            if (next == boundary.end() || next->first != b || (std::next(next) != boundary.end() && std::next(next)->first == b)) {
+                ++e;
+                continue;
+            }
+            size_t c = next->second;
+            bool dent = c != a && cross(a, b, c) < -min_cross;
+            for (size_t i = 0; dent && i != pts_.size(); ++i)
+                dent = i == a || i == b || i == c
+                    || cross(a, c, i) < 0 || cross(c, b, i) < 0 || cross(b, a, i) < 0;
+            if (!dent) {
+                ++e;
+                continue;
+            }
+
+            tris_.push_back(make_triangle(a, c, b));
+            boundary.erase(next);
+            e = boundary.erase(e);
+            if (!boundary.erase({ c, a }))
+                boundary.insert({ a, c });
+            changed = true;
+        }
+    }
+}
+
+triangulation::triangle triangulation::make_triangle(size_t a, size_t b, size_t c) const
+{
+    const point& pa = pts_[a];
+    const point& pb = pts_[b];
+    const point& pc = pts_[c];
+
+    double d = 2 * (pa.x * (pb.y - pc.y) + pb.x * (pc.y - pa.y) + pc.x * (pa.y - pb.y));
+    double a2 = pa.x*pa.x + pa.y*pa.y, b2 = pb.x*pb.x + pb.y*pb.y, c2 = pc.x*pc.x + pc.y*pc.y;
+    point center(
+        (a2 * (pb.y - pc.y) + b2 * (pc.y - pa.y) + c2 * (pa.y - pb.y)) / d,
+        (a2 * (pc.x - pb.x) + b2 * (pa.x - pc.x) + c2 * (pb.x - pa.x)) / d,
+        0
+    );
+    return { {{ a, b, c }}, center, (pa - center).project_xy().length() };
+}
+
+void triangulation::build_buckets()
+{
+    // About one triangle per bucket
+    bucket_size_ = std::max(sqrt(bbox_.size().x * bbox_.size().y / tris_.size()), 1e-3);
+    buckets_x_ = size_t(bbox_.size().x / bucket_size_) + 1;
+    buckets_y_ = size_t(bbox_.size().y / bucket_size_) + 1;
+    buckets_.assign(buckets_x_ * buckets_y_, {});
+
+    point origin = bbox_.bottom_left();
+    for (size_t i = 0; i != tris_.size(); ++i) {
+        ::bounding_box b;
+        for (size_t v: tris_[i].v)
+            b.extend(pts_[v]);
+        size_t x0 = size_t((b.bottom_left().x - origin.x) / bucket_size_);
+        size_t y0 = size_t((b.bottom_left().y - origin.y) / bucket_size_);
+        size_t x1 = std::min(size_t((b.top_right().x - origin.x) / bucket_size_), buckets_x_ - 1);
+        size_t y1 = std::min(size_t((b.top_right().y - origin.y) / bucket_size_), buckets_y_ - 1);
+        for (size_t y = y0; y <= y1; ++y)
+            for (size_t x = x0; x <= x1; ++x)
+                buckets_[y * buckets_x_ + x].push_back(i);
+    }
+}
+
+void triangulation::barycentric(const triangle& t, const point& pt, double& u, double& v) const
+{
+    const point& a = pts_[t.v[0]];
+    vector ab = (pts_[t.v[1]] - a).project_xy(), ac = (pts_[t.v[2]] - a).project_xy(), ap = (pt - a).project_xy();
+    double d = ab.x * ac.y - ab.y * ac.x;
+    u = (ap.x * ac.y - ap.y * ac.x) / d;
+    v = (ab.x * ap.y - ab.y * ap.x) / d;
+}
+
+double triangulation::interpolate(const triangle& t, const point& pt, bool clamp) const
+{
+    const point& a = pts_[t.v[0]];
+    const point& b = pts_[t.v[1]];
+    const point& c = pts_[t.v[2]];
+
+    double u, v;
+    barycentric(t, pt, u, v);
+    if (clamp && (u < 0 || v < 0 || u + v > 1)) {
+        // Nearest point on the edges
+        double best = INFINITY;
+        const point* ends[3][2] = { { &a, &b }, { &b, &c }, { &c, &a } };
+        double z = 0;
+        for (const auto& e: ends) {
+            vector s = (*e[1] - *e[0]).project_xy();
+            double k = std::min(std::max(((pt - *e[0]).project_xy() * s) / (s * s), 0.0), 1.0);
+            point q = *e[0] + (*e[1] - *e[0]) * k;
+            double dist = (pt - q).project_xy().length();
+            if (dist < best) {
+                best = dist;
+                z = q.z;
+            }
+        }
+        return z;
+    }
+    return a.z + (b.z - a.z) * u + (c.z - a.z) * v;
+}
+
+double triangulation::operator()(const point& pt) const
+{
+    point origin = bbox_.bottom_left();
+    double fx = floor((pt.x - origin.x) / bucket_size_);
+    double fy = floor((pt.y - origin.y) / bucket_size_);
+    size_t x = size_t(std::min(std::max(fx, 0.0), buckets_x_ - 1.0));
+    size_t y = size_t(std::min(std::max(fy, 0.0), buckets_y_ - 1.0));
+    const std::vector<size_t>& bucket = buckets_[y * buckets_x_ + x];
+
+    static const double EPSILON = 1e-9;
+    for (size_t i: bucket) {
+        double u, v;
+        barycentric(tris_[i], pt, u, v);
+        if (u >= -EPSILON && v >= -EPSILON && u + v <= 1 + EPSILON)
+            return interpolate(tris_[i], pt, false);
+    }
+
+    // Outside the hull: the closest triangle decides
+    double best = INFINITY;
+    const triangle* closest = nullptr;
+    auto consider = [&](size_t i) {
+        const triangle& t = tris_[i];
+        double d = 0;
+        for (size_t v: t.v)
+            d += (pts_[v] - pt).project_xy().length();
+        if (d < best) {
+            best = d;
+            closest = &t;
+        }
+    };
+    if (!bucket.empty()) {
+        for (size_t i: bucket)
+            consider(i);
+    } else {
+        for (size_t i = 0; i != tris_.size(); ++i)
+            consider(i);
+    }
+    return interpolate(*closest, pt, true);
+}
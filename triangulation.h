@@ -0,0 +1,42 @@
+#pragma once
+
+#include "geom.h"
+#include <vector>
+#include <array>
+
+// Delaunay triangulation of scattered measurements, interpolating
+// their heights linearly across each triangle
+class triangulation {
+public:
+    explicit triangulation(std::vector<point> pts);
+
+    size_t size() const { return tris_.size(); }
+    const std::vector<point>& points() const { return pts_; }
+
+    // Height at `pt`; outside the convex hull, the height
+    // at the nearest point of the closest triangle
+    double operator()(const point& pt) const;
+
+private:
+    struct triangle {
+        std::array<size_t, 3> v;
+        point center;  // of the circumscribed circle
+        double r;
+    };
+
+    triangle make_triangle(size_t a, size_t b, size_t c) const;
+    void fill_hull();
+    void build_buckets();
+    void barycentric(const triangle& t, const point& pt, double& u, double& v) const;
+    double interpolate(const triangle& t, const point& pt, bool clamp) const;
+
+    std::vector<point> pts_;
+    std::vector<triangle> tris_;
+
+    // Triangles overlapping each cell of a uniform grid over the points,
+    // so that lookups only test a few of them
+    ::bounding_box bbox_;
+    size_t buckets_x_, buckets_y_;
+    double bucket_size_;
+    std::vector<std::vector<size_t>> buckets_;
+};
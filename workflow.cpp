@@ -4,8 +4,16 @@
 #include "gcode.h"
 #include "settings.h"
 #include "height_map.h"
+#include "toolpath.h"
+#include "route.h"
+#include "planner.h"
+#include "shapes.h"
+#include "probing.h"
 #include <iostream>
 #include <fstream>
+#include <iomanip>
+#include <ctime>
+#include <sstream>
 #include <algorithm>
 #include <cassert>
 
@@ -71,8 +79,50 @@ std::unique_ptr<gcode> workflow::load_gcode(const std::string& filename)
         throw error("layer exceeds PCB border");
 
     std::cerr << "Loaded " << filename << "; " << std::distance(g->begin(), g->end()) << " commands" << std::endl;
+    
+    if (settings::g_params.cleanup_gcode) {
+        auto stats = g->cleanup();
+        commands_saved_ += stats.total();
+        std::cerr << "Cleanup: " << stats.total() << " commands removed ("
+                  << stats.modal << " redundant modal, " << stats.zero_length << " zero-length, "
+                  << stats.duplicates << " duplicate cuts); "
+                  << commands_saved_ << " saved so far" << std::endl;
+    }
+    if (settings::g_params.arc_tolerance > 0) {
+        size_t saved = g->fit_arcs(settings::g_params.arc_tolerance);
+        commands_saved_ += saved;
+        std::cerr << "Arc fitting: " << std::distance(g->begin(), g->end()) << " commands left; "
+                  << saved << " saved" << std::endl;
+    }
     return g;
 }
+
+void workflow::load_drill(const std::string& filename)
+{
+    drill_ = load_gcode(filename);
+    drill_travel_ = { 0, 0 };
+    drill_tools_merged_ = 0;
+    if (settings::g_params.optimize_travel) {
+        plan_drill();
+        std::cerr << "Drill plan: " << drill_tools_merged_ << " tool changes merged; travel distance "
+                  << std::fixed << std::setprecision(1) << drill_travel_.before << " mm -> "
+                  << drill_travel_.after << " mm" << std::endl;
+    }
+}
+
+void workflow::load_mill(const std::string& filename)
+{
+    auto g = load_gcode(filename);
+    if (settings::g_params.optimize_travel) {
+        auto stats = g->optimize_travel();
+        std::cerr << "Travel distance: " << std::fixed << std::setprecision(1)
+                  << stats.before << " mm -> " << stats.after << " mm; "
+                  << stats.before - stats.after << " mm saved" << std::endl;
+    }
+    if (size_t links = g->link_chains(settings::g_params.link_distance))
+        std::cerr << links << " retracts replaced by direct cuts" << std::endl;
+    mill_ = std::move(g);
+}
     
 void workflow::set_orientation(double angle_hint /* = 0 */)
 {
@@ -194,18 +244,48 @@ void workflow::use_reference_points()
     }
 }
 
-void workflow::run(const std::string& prompt, const gcode& gc)
+// How far height map compensated arcs may stray from the surface
+static const double ARC_Z_TOLERANCE = 0.01 /*mm*/;
+
+std::unique_ptr<gcode> workflow::prepare(const gcode& gc) const
 {
-    require_border();
-    require_orientation();
+    auto surface = [this](const point& pt) {
+        return height_map_ ? (*height_map_)(point(pt.x, pt.y, 0)).z : 0;
+    };
+    
     auto c = std::make_unique<gcode>(gc);
     c->break_long_legs();
     if (height_map_)
-        c->xform_by(*height_map_);
-    c->xform_by(orient_);
-    c->xform_by([this](const point& pt) { return pt + vector::axis::z(z_adjustment_); });
+        c->split_arcs(surface, ARC_Z_TOLERANCE);
+
+    toolpath tp(*c);
+    if (height_map_)
+        tp.apply(*height_map_);
+    tp.shift_z(z_adjustment_);
+    
+    if (settings::g_params.rapid_air_moves) {
+        tp.store(*c);
+        // The toolpath is already shifted by the adjustment, so the surface is as well
+        c->rapid_air_moves(
+            [&](const point& pt) { return surface(pt) + z_adjustment_; },
+            settings::g_params.air_clearance
+        );
+        tp = toolpath(*c);
+    }
     
-    current_ = std::move(c);
+    if (orient_.defined())
+        tp.orient(orient_);
+    tp.store(*c);
+    return c;
+}
+
+void workflow::run(const std::string& prompt, const gcode& gc)
+{
+    require_border();
+    require_orientation();
+    
+    lazy_.reset();
+    current_ = prepare(gc);
     current_->send_to(cnc(), prompt);
     current_.reset();
 }
@@ -242,6 +322,39 @@ void workflow::resume()
     if (current_)
         current_->send_to(cnc(), "Working");
     current_.reset();
+    if (lazy_)
+        mill_lazily();
+}
+
+void workflow::estimate(const std::string& layer) const
+{
+    const gcode* gc =
+        (layer == "drill") ? drill_.get()
+        : (layer == "mill") ? mill_.get()
+        : (layer == "cut") ? border_.get()
+        : throw error("unknown layer: " + layer);
+    if (!gc)
+        throw error("layer not loaded");
+    
+    auto prepared = prepare(*gc);
+    auto times = motion_planner(machine_limits::from(*cnc_)).estimate(*prepared, cnc_->position());
+    
+    double feed = 0, rapid = 0, other = 0;
+    for (size_t i = 0; i != prepared->size(); ++i) {
+        const gcmd& c = (*prepared)[i];
+        (c.equals('G', 0) ? rapid : (c.letter() == 'G' && c.arg() <= 3) ? feed : other) += times[i];
+    }
+    
+    auto hms = [](double t) {
+        size_t s = size_t(t + 0.5);
+        std::ostringstream out;
+        out << s / 3600 << ':' << std::setfill('0') << std::setw(2) << (s % 3600) / 60
+            << ':' << std::setfill('0') << std::setw(2) << s % 60;
+        return out.str();
+    };
+    std::cout << "Estimated time: " << hms(feed + rapid + other)
+              << " (feed " << hms(feed) << ", rapid " << hms(rapid) << ", dwell " << hms(other) << "); "
+              << prepared->size() << " commands" << std::endl;
 }
 
 void workflow::dump_layer(const gcode* gc, const std::string& filename) const
@@ -252,9 +365,11 @@ void workflow::dump_layer(const gcode* gc, const std::string& filename) const
         throw error("layer not loaded");
     
     gcode tmp(*gc);
+    toolpath tp(tmp);
     if (height_map_)
-        tmp.xform_by(*height_map_);
-    tmp.xform_by(orient_);
+        tp.apply(*height_map_);
+    tp.orient(orient_);
+    tp.store(tmp);
     
     std::ofstream f(filename);
     for (const gcmd& cmd: tmp)
@@ -269,21 +384,148 @@ std::vector<point> workflow::reference_points() const
     return make_reference_points(*border_);
 }
 
+static const std::string TOOL_PROMPT = "Change to tool dia=";
+
+void workflow::plan_drill()
+{
+    if (!drill_)
+        throw error("drill not loaded");
+    const gcode& gc = *drill_;
+    
+    // A block runs from one tool change to the next: a header changing the
+    // tool and starting the spindle, the holes, and a footer after them
+    struct tool_block {
+        double dia;
+        size_t begin, end;
+        std::vector<gcode::chain> holes;
+        size_t header_end, footer_begin;
+    };
+    
+    std::vector<tool_block> blocks;
+    for (size_t i = 0; i != gc.size(); ++i) {
+        if (gc[i].letter() == 'T')
+            blocks.push_back({ NAN, i, gc.size(), {}, 0, 0 });
+        if (blocks.empty())
+            continue;
+        blocks.back().end = i + 1;
+        if (gc[i].letter() == '*' && starts_with(gc[i].str_arg(), TOOL_PROMPT))
+            blocks.back().dia = lexical_cast<double>(gc[i].str_arg().substr(TOOL_PROMPT.size()));
+    }
+    if (blocks.empty())
+        return;
+    
+    for (const gcode::chain& ch: gc.chains()) {
+        auto b = std::find_if(blocks.rbegin(), blocks.rend(), [&ch](const tool_block& b) { return b.begin <= ch.begin; });
+        if (b == blocks.rend())
+            return; // holes before the first tool change; leave the file as is
+        if (!b->holes.empty() && b->holes.back().section != ch.section)
+            return; // something other than holes between holes
+        b->holes.push_back(ch);
+    }
+    
+    // Without holes, the header ends with the spindle start and its dwell
+    for (tool_block& b: blocks) {
+        if (!b.holes.empty()) {
+            b.header_end = b.holes.front().begin;
+            b.footer_begin = b.holes.back().end;
+            continue;
+        }
+        b.header_end = b.begin;
+        for (size_t i = b.begin; i != b.end; ++i)
+            if (gc[i].equals('M', 3) || gc[i].equals('M', 4))
+                b.header_end = i + 1;
+        while (b.header_end != b.end && gc[b.header_end].equals('G', 4))
+            ++b.header_end;
+        b.footer_begin = b.header_end;
+    }
+    
+    // Group blocks drilling the same diameter, in order of first appearance
+    std::vector<std::vector<const tool_block*>> groups;
+    for (const tool_block& b: blocks) {
+        auto g = std::find_if(groups.begin(), groups.end(), [&b](const auto& g) {
+            return fabs(g.front()->dia - b.dia) < 1e-3;
+        });
+        if (g != groups.end())
+            g->push_back(&b);
+        else
+            groups.push_back({ &b });
+    }
+    
+    auto hole_item = [](const gcode::chain& ch) -> route_item {
+        return { ch.entry, ch.exit, (ch.exit - ch.entry).project_xy().length() < 1e-6 };
+    };
+    auto set_feed = [](std::vector<gcmd>& out, double& feed, double new_feed) {
+        if (!std::isnan(new_feed) && !(fabs(feed - new_feed) < 1e-6))
+            out.push_back(gcmd::parse(point(), "F" + lexical_cast<std::string>(new_feed)));
+        feed = new_feed;
+    };
+    
+    std::vector<route_item> orig_items;
+    for (const tool_block& b: blocks)
+        for (const gcode::chain& ch: b.holes)
+            orig_items.push_back(hole_item(ch));
+    drill_travel_.before = route_length(orig_items, identity_route(orig_items.size()), point());
+    drill_travel_.after = 0;
+    
+    std::vector<gcmd> out(gc.begin(), gc.begin() + blocks.front().begin);
+    point pos;
+    double feed = NAN;
+    for (const auto& group: groups) {
+        const tool_block& first = *group.front();
+        out.insert(out.end(), gc.begin() + first.begin, gc.begin() + first.header_end);
+        
+        std::vector<gcode::chain> holes;
+        for (const tool_block* b: group)
+            holes.insert(holes.end(), b->holes.begin(), b->holes.end());
+        std::vector<route_item> items;
+        std::transform(holes.begin(), holes.end(), std::back_inserter(items), hole_item);
+        
+        auto route = plan_route(items, pos);
+        drill_travel_.after += route_length(items, route, pos);
+        for (const route_step& step: route) {
+            const gcode::chain& ch = holes[step.index];
+            set_feed(out, feed, ch.feed_in);
+            out.insert(out.end(), gc.begin() + ch.begin, gc.begin() + ch.end);
+            feed = ch.feed_out;
+            pos = step.reversed ? ch.entry : ch.exit;
+        }
+        
+        // Headers of merged blocks would only stop and restart the spindle
+        // and move about; their messages go after the holes, with the footers
+        auto message = [](const gcmd& c) {
+            return c.letter() == '*' && !starts_with(c.str_arg(), TOOL_PROMPT);
+        };
+        for (const tool_block* b: group) {
+            if (b != &first)
+                std::copy_if(gc.begin() + b->begin, gc.begin() + b->header_end, std::back_inserter(out), message);
+            if (b != &blocks.back())
+                out.insert(out.end(), gc.begin() + b->footer_begin, gc.begin() + b->end);
+        }
+    }
+    
+    const tool_block& last = blocks.back();
+    if (!last.holes.empty())
+        set_feed(out, feed, last.holes.back().feed_out);
+    out.insert(out.end(), gc.begin() + last.footer_begin, gc.begin() + last.end);
+    
+    drill_tools_merged_ = blocks.size() - groups.size();
+    drill_ = std::make_unique<gcode>(out.begin(), out.end());
+}
+
 std::vector<circular_area> workflow::drills() const
 {
     require_border();
     if (!drill_)
         throw error("drill not loaded");
     
-    static const std::string PROMPT = "Change to tool dia=";
     double dia = 0.6;
     
     std::vector<circular_area> ret;
     for (const auto& cmd: *drill_) {
         if (cmd.equals('G', 1) && cmd.point().z < 0) {
             ret.push_back({{ cmd.point().x, cmd.point().y, 0 }, dia / 2});
-        } else if (cmd.letter() == '*' && starts_with(cmd.str_arg(), PROMPT)) {
-            dia = lexical_cast<double>(cmd.str_arg().substr(PROMPT.size()));
+        } else if (cmd.letter() == '*' && starts_with(cmd.str_arg(), TOOL_PROMPT)) {
+            dia = lexical_cast<double>(cmd.str_arg().substr(TOOL_PROMPT.size()));
         }
     }
     
@@ -298,7 +540,109 @@ void workflow::zero_height_map()
     auto h = std::make_unique<height_map>(border_->bounding_box(), std::vector<circular_area>());
     for (point& pt: *h)
         pt.z = 0;
+    h->set_interpolation(interpolation_);
     height_map_ = std::move(h);
+    lazy_.reset();
+}
+
+namespace {
+
+// Touches the surface at one point after another. Retracts only as high as
+// the surface measured around each move requires; where neighbours pin the
+// surface down, rapids right above it and touches from there, elsewhere
+// seeks it first, stopping short of the nearest measurement if there is one.
+class surface_prober {
+public:
+    surface_prober(cnc_machine& cnc, const orientation& o, double reach):
+        cnc_(cnc), orient_(o), reach_(reach) {}
+
+    // Height of the surface at `pt`, in board coordinates
+    double operator()(const point& pt);
+
+    // Records a measurement taken some other way
+    void add(const point& pt);
+
+    const std::vector<point>& measured() const { return measured_; }
+    size_t probes() const { return probes_; }
+
+    void start(const std::string& prompt, size_t count) { progress_ = std::make_unique<interactive::progress_bar>(prompt, count); }
+    void finish() { progress_.reset(); }
+
+    // Prints how close seeks and predictions came to the surface
+    void report() const;
+
+private:
+    cnc_machine& cnc_;
+    const orientation& orient_;
+    double reach_;
+    std::vector<point> measured_;
+    std::unique_ptr<interactive::progress_bar> progress_;
+
+    size_t probes_ = 0;
+    double seek_error_ = 0, max_seek_error_ = 0;
+    size_t seeks_ = 0;
+    double prediction_error_ = 0;
+    size_t predictions_ = 0;
+};
+
+double surface_prober::operator()(const point& pt)
+{
+    static const double MAX_PREDICTION_RMS = 0.02;
+    const auto& params = settings::g_params;
+    double predicted = NAN, approach = NAN, expected = NAN;
+    if (!measured_.empty()) {
+        double top = surface_top(measured_, measured_.back(), pt, reach_);
+        cnc_.move_z(std::isnan(top) ? settings::MILL.travel_z : top + params.probe_clearance);
+
+        double rms = NAN;
+        predicted = predict_surface(measured_, pt, reach_, rms);
+        if (!std::isnan(predicted) && rms < MAX_PREDICTION_RMS)
+            approach = predicted + params.probe_margin + 3 * rms;
+        else if (!std::isnan(top))
+            expected = std::min_element(measured_.begin(), measured_.end(), [&pt](const point& a, const point& b) {
+                return (a - pt).project_xy().length() < (b - pt).project_xy().length();
+            })->z;
+    }
+    cnc_.move_xy(orient_(pt));
+    auto res = cnc_.probe(approach, expected);
+    if (!std::isnan(res.seek_z)) {
+        seek_error_ += fabs(res.seek_z - res.z);
+        max_seek_error_ = std::max(max_seek_error_, fabs(res.seek_z - res.z));
+        ++seeks_;
+    }
+    if (!std::isnan(approach)) {
+        prediction_error_ += fabs(predicted - res.z);
+        ++predictions_;
+    }
+    add(point(pt.x, pt.y, res.z));
+    return res.z;
+}
+
+void surface_prober::add(const point& pt)
+{
+    measured_.push_back(pt);
+    ++probes_;
+    if (progress_)
+        progress_->increment();
+}
+
+void surface_prober::report() const
+{
+    if (seeks_)
+        std::cerr << std::endl << "Seek vs touch: " << std::fixed << std::setprecision(3)
+                  << seek_error_ / seeks_ << " mm average, " << max_seek_error_ << " mm max";
+    if (predictions_)
+        std::cerr << std::endl << predictions_ << " probes approached by prediction; average error "
+                  << std::fixed << std::setprecision(3) << prediction_error_ / predictions_ << " mm";
+}
+
+} // namespace
+
+void workflow::set_interpolation(height_map::interpolation i)
+{
+    interpolation_ = i;
+    if (height_map_)
+        height_map_->set_interpolation(i);
 }
 
 void workflow::scan_height_map()
@@ -306,37 +650,389 @@ void workflow::scan_height_map()
     require_border();
     require_orientation();
     
-    auto h = std::make_unique<height_map>(border_->bounding_box(), drills());
+    // Adaptive scans start from a coarser grid and refine it where needed
+    const auto& params = settings::g_params;
+    bool adaptive = params.hmap_tolerance > 0;
+    auto h = std::make_unique<height_map>(
+        border_->bounding_box(), drills(),
+        adaptive ? 2 * params.hmap_cell_size : params.hmap_cell_size
+    );
+    
+    std::vector<point> cuts;
+    std::vector<polyline> loops;
+    const polyline* outline = nullptr;
+    auto inside = [&](const point& pt) {
+        static const double BORDER_MARGIN = 1;
+        return outline ? move_inside(*outline, pt, BORDER_MARGIN) : pt;
+    };
+    if (params.hmap_sparse) {
+        // Only cells where layers get cut matter, and only on the board itself
+        double step = std::min(h->cell_size_x(), h->cell_size_y()) / 4;
+        for (const gcode* layer: { mill_.get(), drill_.get() }) {
+            if (layer) {
+                auto pts = trace_cuts(*layer, step);
+                cuts.insert(cuts.end(), pts.begin(), pts.end());
+            }
+        }
+        if (cuts.empty())
+            throw error("nothing to be cut yet");
+        
+        // The board outline is the widest of the border loops
+        loops = shapes::outline(*border_);
+        auto area = [](const polyline& p) {
+            ::bounding_box b;
+            for (const point& pt: p)
+                b.extend(pt);
+            return b.size().x * b.size().y;
+        };
+        auto widest = std::max_element(loops.begin(), loops.end(), [&](const polyline& a, const polyline& b) {
+            return area(a) < area(b);
+        });
+        if (widest != loops.end())
+            outline = &*widest;
+        
+        h->restrict_to(cuts, inside);
+    }
     
     interactive::change_tool(cnc(), "Change tool to engraving bit");
     
-    interactive::progress_bar progress("Scanning height map", std::distance(h->begin(), h->end()));
+    std::vector<size_t> scan_points = h->scan_points();
+    size_t grid = scan_points.size();
     
     double travel_z = settings::MILL.travel_z;
+    surface_prober probe(cnc(), orient_, 1.5 * std::max(h->cell_size_x(), h->cell_size_y()));
+    
+    time_t started_at = time(0);
     cnc().move_z(travel_z);
-    for (point& pt: *h) {
-        cnc().move_xy(orient_(pt));
-        pt.z = cnc().probe();
-        cnc().move_z(travel_z);
-        progress.increment();
+    
+    if (params.hmap_plane_tolerance > 0) {
+        // A rigid board on a flat bed is little more than a tilted plane:
+        // fit one through the corners and the center, and take it as
+        // a single cell map unless the probes stray from it too far
+        ::bounding_box box = border_->bounding_box();
+        auto plane = std::make_unique<height_map>(box, drills(), std::max(box.size().x, box.size().y));
+        if (params.hmap_sparse)
+            plane->restrict_to(cuts, inside);
+        
+        std::vector<point> pts(plane->begin(), plane->end());
+        pts.push_back(plane->place(inside(box.center())));
+        probe.start("Fitting a plane", pts.size());
+        std::vector<route_item> items;
+        for (const point& pt: pts)
+            items.push_back({ pt, pt, false });
+        for (const route_step& step: plan_route(items, orient_.inv()(cnc().position())))
+            probe(pts[step.index]);
+        probe.finish();
+        
+        double rms = NAN;
+        predict_surface(probe.measured(), box.center(), INFINITY, rms);
+        std::cerr << std::endl << "Plane fit residual: " << std::fixed << std::setprecision(3) << rms << " mm";
+        if (!std::isnan(rms) && rms <= params.hmap_plane_tolerance) {
+            for (point& pt: *plane) {
+                double r;
+                pt.z = predict_surface(probe.measured(), pt, INFINITY, r);
+            }
+            cnc().move_z(travel_z);
+            plane->set_interpolation(interpolation_);
+            height_map_ = std::move(plane);
+            std::cerr << std::endl;
+            return;
+        }
+        std::cerr << ", scanning the grid" << std::endl;
     }
     
+    probe.start("Scanning height map", adaptive ? std::max(grid, params.hmap_max_probes) : grid);
+    std::vector<route_item> items;
+    for (size_t i: scan_points)
+        items.push_back({ *(h->begin() + i), *(h->begin() + i), false });
+    auto route = plan_route(items, orient_.inv()(cnc().position()));
+    
+    if (params.stream_probes) {
+        // Nothing to adapt the approach to before the grid is measured anyway
+        std::vector<point> pts;
+        for (const route_step& step: route)
+            pts.push_back(orient_(*(h->begin() + scan_points[step.index])));
+        auto results = cnc().probe_all(pts, travel_z);
+        for (size_t i = 0; i != route.size(); ++i) {
+            point& pt = *(h->begin() + scan_points[route[i].index]);
+            pt.z = results[i].z;
+            probe.add(pt);
+        }
+    } else {
+        for (const route_step& step: route) {
+            point& pt = *(h->begin() + scan_points[step.index]);
+            pt.z = probe(pt);
+        }
+    }
+    
+    h->fill_gaps();
+    
+    if (adaptive) {
+        h->refine(std::ref(probe), params.hmap_tolerance, [&]() {
+            return probe.probes() < params.hmap_max_probes && difftime(time(0), started_at) < params.hmap_max_time;
+        });
+        std::cerr << std::endl << probe.probes() << " probes, " << h->cell_count() << " cells";
+    }
+    probe.finish();
+    cnc().move_z(travel_z);
+    probe.report();
+    
+    h->set_interpolation(interpolation_);
     height_map_ = std::move(h);
+    lazy_.reset();
     std::cerr << std::endl;
 }
 
+void workflow::verify_height_map()
+{
+    require_orientation();
+    if (!height_map_)
+        throw error("height map not loaded; use 'hmap scan' or 'hmap load'");
+    
+    const auto& params = settings::g_params;
+    height_map& h = *height_map_;
+    std::vector<size_t> stored = h.scan_points();
+    std::vector<point> pts;
+    for (size_t i: stored)
+        pts.push_back(*(h.begin() + i));
+    if (pts.empty() || !std::all_of(pts.begin(), pts.end(), [](const point& pt) { return pt.defined(); }))
+        throw error("height map not measured");
+    
+    // A well spread subset: each next point is the farthest from those taken
+    size_t count = std::min(pts.size(), std::max<size_t>(5, pts.size() / 8));
+    std::vector<size_t> sample = { 0 };
+    std::vector<double> dist(pts.size(), INFINITY);
+    while (sample.size() < count) {
+        for (size_t i = 0; i != pts.size(); ++i)
+            dist[i] = std::min(dist[i], (pts[i] - pts[sample.back()]).project_xy().length());
+        sample.push_back(std::max_element(dist.begin(), dist.end()) - dist.begin());
+    }
+    
+    interactive::change_tool(cnc(), "Change tool to engraving bit");
+    
+    double travel_z = settings::MILL.travel_z;
+    double reach = 1.5 * std::max(h.cell_size_x(), h.cell_size_y());
+    surface_prober probe(cnc(), orient_, reach);
+    std::vector<double> fresh(pts.size(), NAN);
+    auto probe_all = [&](const std::vector<size_t>& which, const std::string& prompt) {
+        std::vector<route_item> items;
+        for (size_t i: which)
+            items.push_back({ pts[i], pts[i], false });
+        probe.start(prompt, which.size());
+        for (const route_step& s: plan_route(items, orient_.inv()(cnc().position())))
+            fresh[which[s.index]] = probe(pts[which[s.index]]);
+        probe.finish();
+    };
+    cnc().move_z(travel_z);
+    probe_all(sample, "Verifying height map");
+    
+    // Offset and tilt: a plane through the changes at the points taken
+    std::vector<point> changes;
+    double mean = 0;
+    for (size_t i: sample) {
+        changes.push_back(point(pts[i].x, pts[i].y, fresh[i] - pts[i].z));
+        mean += changes.back().z / sample.size();
+    }
+    auto shift = [&](const point& pt) {
+        double rms = NAN;
+        double s = predict_surface(changes, pt, INFINITY, rms);
+        return std::isnan(s) ? mean : s;
+    };
+    point center = h.bounding_box().center();
+    double rms = NAN;
+    predict_surface(changes, center, INFINITY, rms);
+    std::cerr << std::endl << "Offset " << std::fixed << std::setprecision(3) << shift(center) << " mm, tilt "
+              << (shift(center + vector(100, 0, 0)) - shift(center)) << " / "
+              << (shift(center + vector(0, 100, 0)) - shift(center)) << " mm per 100 mm in X / Y";
+    if (!std::isnan(rms))
+        std::cerr << ", " << rms << " mm residual";
+    
+    // Local drift: probe everything around points the plane misses, and
+    // further on for as long as the points probed keep missing it
+    std::vector<double> expected(pts.size());
+    for (size_t i = 0; i != pts.size(); ++i)
+        expected[i] = pts[i].z + shift(pts[i]);
+    std::vector<size_t> off;
+    for (size_t i: sample)
+        if (fabs(fresh[i] - expected[i]) > params.hmap_verify_tolerance)
+            off.push_back(i);
+    while (!off.empty()) {
+        std::vector<size_t> around;
+        for (size_t i = 0; i != pts.size(); ++i) {
+            if (!std::isnan(fresh[i]))
+                continue;
+            if (std::any_of(off.begin(), off.end(), [&](size_t k) { return (pts[i] - pts[k]).project_xy().length() <= reach; }))
+                around.push_back(i);
+        }
+        if (around.empty())
+            break;
+        probe_all(around, "Re-probing drifted cells");
+        off.clear();
+        for (size_t i: around)
+            if (fabs(fresh[i] - expected[i]) > params.hmap_verify_tolerance)
+                off.push_back(i);
+    }
+    cnc().move_z(travel_z);
+    probe.report();
+    
+    for (point& pt: h)
+        pt.z += shift(pt);
+    for (size_t i = 0; i != pts.size(); ++i)
+        if (!std::isnan(fresh[i]))
+            (h.begin() + stored[i])->z = fresh[i];
+    h.fill_gaps();
+    
+    std::cerr << std::endl << probe.probes() << " of " << pts.size() << " points probed again" << std::endl;
+}
+
+// What scan_and_mill() has done so far, kept until the job is finished
+// so that resume() can carry on with the rest of it
+struct workflow::lazy_mill {
+    lazy_mill(const gcode& gc, cnc_machine& cnc, const ::orientation& o, double reach):
+        gc(gc), chains(gc.chains()), probe(cnc, o, reach) {}
+
+    gcode gc;
+    std::vector<gcode::chain> chains;
+    size_t next = 0, from = 0;          // the chain to cut next and where its part begins
+    std::vector<bool> used, probed;
+    std::vector<point> touched;         // a point in each cell used so far
+    surface_prober probe;
+    bool spindle = false;
+};
+
+void workflow::scan_and_mill()
+{
+    require_border();
+    require_orientation();
+    if (!mill_)
+        throw error("load mill gcode first");
+    if (mill_->chains().empty())
+        throw error("nothing to be milled");
+    
+    height_map_ = std::make_unique<height_map>(border_->bounding_box(), drills(), settings::g_params.hmap_cell_size);
+    height_map_->set_interpolation(interpolation_);
+    height_map& h = *height_map_;
+    
+    lazy_ = std::make_shared<lazy_mill>(*mill_, cnc(), orient_, 1.5 * std::max(h.cell_size_x(), h.cell_size_y()));
+    lazy_->used.assign(h.cell_count_x() * h.cell_count_y(), false);
+    lazy_->probed.assign((h.cell_count_x() + 1) * (h.cell_count_y() + 1), false);
+    
+    interactive::change_tool(cnc(), "Change tool to engraving bit");
+    mill_lazily();
+}
+
+void workflow::mill_lazily()
+{
+    lazy_mill& s = *lazy_;
+    height_map& h = *height_map_;
+    size_t nx = h.cell_count_x(), ny = h.cell_count_y();
+    double travel_z = settings::MILL.travel_z;
+    double step = std::min(h.cell_size_x(), h.cell_size_y()) / 4;
+    
+    // A Catmull-Rom patch reads the nodes of the cells around its own
+    // as well, so those get probed before it is cut through
+    int around = (interpolation_ == height_map::interpolation::bicubic) ? 1 : 0;
+    
+    // Each chain is cut along with whatever precedes it, right after
+    // the corners of the cells it enters for the first time are probed
+    while (s.next != s.chains.size()) {
+        size_t c = s.next;
+        size_t to = (c + 1 == s.chains.size()) ? s.gc.size() : s.chains[c].end;
+        gcode part(s.gc.begin() + s.from, s.gc.begin() + to);
+        
+        // Something has to be measured before anything gets moved over
+        std::vector<point> cuts = trace_cuts(part, step);
+        if (s.touched.empty() && cuts.empty())
+            cuts.push_back(s.chains[c].entry);
+        
+        // Corners left unmeasured by an interruption are probed again
+        std::vector<bool> queued = s.probed;
+        std::vector<size_t> fresh;
+        for (const point& pt: cuts) {
+            int cx = int(std::min(std::max(floor((pt.x - h.bounding_box().bottom_left().x) / h.cell_size_x()), 0.0), nx - 1.0));
+            int cy = int(std::min(std::max(floor((pt.y - h.bounding_box().bottom_left().y) / h.cell_size_y()), 0.0), ny - 1.0));
+            for (int y = std::max(cy - around, 0); y <= std::min(cy + around, int(ny) - 1); ++y) {
+                for (int x = std::max(cx - around, 0); x <= std::min(cx + around, int(nx) - 1); ++x) {
+                    if (!s.used[y*nx + x]) {
+                        s.used[y*nx + x] = true;
+                        s.touched.push_back(h.bounding_box().bottom_left() + vector((x + 0.5) * h.cell_size_x(), (y + 0.5) * h.cell_size_y(), 0));
+                    }
+                    for (size_t corner: { y*(nx+1) + x, y*(nx+1) + x+1, (y+1)*(nx+1) + x, (y+1)*(nx+1) + x+1 }) {
+                        if (!queued[corner]) {
+                            queued[corner] = true;
+                            fresh.push_back(corner);
+                        }
+                    }
+                }
+            }
+        }
+        
+        if (!fresh.empty()) {
+            // Let the spindle run down before the probe touches anything
+            if (s.spindle) {
+                cnc().set_spindle_off();
+                cnc().dwell(2);
+            }
+            cnc().move_z(travel_z);
+            
+            std::vector<route_item> items;
+            for (size_t i: fresh)
+                items.push_back({ *(h.begin() + i), *(h.begin() + i), false });
+            s.probe.start("Probing", fresh.size());
+            for (const route_step& r: plan_route(items, orient_.inv()(cnc().position()))) {
+                point& pt = *(h.begin() + fresh[r.index]);
+                pt.z = s.probe(pt);
+                s.probed[fresh[r.index]] = true;
+            }
+            s.probe.finish();
+            cnc().move_z(travel_z);
+            
+            // Moves passing over cells not probed yet follow the nearest measurements
+            h.restrict_to(s.touched, [](const point& pt) { return pt; });
+            h.fill_gaps();
+            
+            if (s.spindle) {
+                cnc().set_spindle_on();
+                cnc().dwell(2);
+            }
+        }
+        
+        for (const gcmd& cmd: part) {
+            if (cmd.equals('M', 3) || cmd.equals('M', 4))
+                s.spindle = true;
+            else if (cmd.equals('M', 5))
+                s.spindle = false;
+        }
+        s.next = c + 1;
+        s.from = to;
+        
+        // Left in current_ if interrupted, for resume() to finish first
+        current_ = prepare(part);
+        current_->send_to(cnc(), "Milling " + std::to_string(c + 1) + "/" + std::to_string(s.chains.size()));
+        current_.reset();
+    }
+    
+    s.probe.report();
+    std::cerr << std::endl << s.probe.probes() << " of " << s.probed.size() << " grid nodes probed" << std::endl;
+    lazy_.reset();
+}
+
 void workflow::load_height_map(const std::string& filename)
 {
     require_border();
     
     std::ifstream f(filename);
     auto h = std::make_unique<height_map>(f);
+    if (!h->bounding_box().bottom_left().defined())
+        h->set_bounding_box(border_->bounding_box()); // saved without one
 
     auto d = h->bounding_box().size() - border_->bounding_box().size();
     if (d.length() > 1e-3)
         throw std::runtime_error("height map size mismatch");
 
+    h->set_interpolation(interpolation_);
     height_map_ = std::move(h);
+    lazy_.reset();
 }
 
 void workflow::save_height_map(const std::string& filename) const
@@ -5,6 +5,7 @@
 #include "height_map.h"
 #include <string>
 #include <stdexcept>
+#include <memory>
 
 class cnc_machine;
 
@@ -22,8 +23,8 @@ public:
     
     void load_border(const std::string& filename);
     
-    void load_drill(const std::string& filename) { drill_ = load_gcode(filename); }
-    void load_mill(const std::string& filename) { mill_ = load_gcode(filename); }
+    void load_drill(const std::string& filename);
+    void load_mill(const std::string& filename);
     
     const ::orientation& orientation() const { return orient_; }
     void set_orientation(double angle_hint = 0);
@@ -32,9 +33,13 @@ public:
     void use_reference_points();
     
     void scan_height_map();
+    // Probes a few of the stored points again, then corrects the map
+    // for the offset and tilt found and re-probes where it still drifts
+    void verify_height_map();
     void save_height_map(const std::string& filename) const;
     void load_height_map(const std::string& filename);
     void zero_height_map();
+    void set_interpolation(height_map::interpolation i);
     
     void adjust_z(double adj) { z_adjustment_ = adj; }
     
@@ -42,17 +47,30 @@ public:
     void mill();
     void cut();
     
+    // Mills with the height map probed as it goes: the corners of each cell
+    // right before the first cut that enters it, and in bicubic mode those
+    // of the cells around it, which its spline passes through
+    void scan_and_mill();
+    
     void resume();
     
+    void estimate(const std::string& layer) const;
+    
     void dump_mill(const std::string& out) const { dump_layer(mill_.get(), out); }
 
     std::vector<point> reference_points() const;
     std::vector<circular_area> drills() const;
+    
+    void plan_drill();
+    const gcode::travel_stats& drill_travel() const { return drill_travel_; }
+    size_t drill_tools_merged() const { return drill_tools_merged_; }
+    size_t commands_saved() const { return commands_saved_; }
 
 for_testing_only:
     workflow(): cnc_(0) {}
     void set_border(std::unique_ptr<gcode> gcode) { border_ = std::move(gcode); }
     void set_drill(std::unique_ptr<gcode> drill) { drill_ = std::move(drill); }
+    const gcode& drill_gcode() const { return *drill_; }
 
 private:
     void require_border() const;
@@ -61,19 +79,27 @@ private:
     std::unique_ptr<gcode> load_gcode(const std::string& filename);
     void dump_layer(const gcode* gc, const std::string& out) const;
     
+    std::unique_ptr<gcode> prepare(const gcode& gc) const;
     void run(const std::string& prompt, const gcode& gc);
+    void mill_lazily();
         
 private:
     cnc_machine* cnc_;
     std::unique_ptr<gcode> border_;
     ::orientation orient_;
     std::unique_ptr<height_map> height_map_;
+    height_map::interpolation interpolation_ = height_map::interpolation::bilinear;
     double z_adjustment_ = 0;
     
     std::unique_ptr<gcode> drill_;
     std::unique_ptr<gcode> mill_;
+    gcode::travel_stats drill_travel_ = { 0, 0 };
+    size_t drill_tools_merged_ = 0;
+    size_t commands_saved_ = 0;
     
     std::unique_ptr<gcode> current_;
+    struct lazy_mill;
+    std::shared_ptr<lazy_mill> lazy_;
     
     bool mirror_ = false;
 };